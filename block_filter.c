@@ -0,0 +1,162 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "block_filter.h"
+
+#define BLOCK_FILTER_VERSION 1
+#define BLOCK_FILTER_BYTE_ORDER 0x01020304u
+
+static const char filter_magic[8] = {'H', 'P', 'B', 'L', 'O', 'O', 'M', '\0'};
+
+// The filters follow the header, block by block, IP filter first.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    LogCacheSource source;
+    uint64_t block_size;
+    uint64_t num_blocks;
+    uint32_t filter_bits;
+    uint32_t num_hashes;
+} BlockFilterHeader;
+
+static size_t filters_size(size_t num_blocks) {
+    return num_blocks * BLOCK_FILTER_FIELDS * BLOCK_FILTER_WORDS * sizeof(uint64_t);
+}
+
+void init_block_filter_index(BlockFilterIndex* index, size_t data_size, size_t block_size) {
+    memset(index, 0, sizeof(*index));
+    index->block_size = block_size;
+    index->num_blocks = (data_size + block_size - 1) / block_size;
+    index->bits = (uint64_t*)calloc(index->num_blocks > 0 ? filters_size(index->num_blocks) : 1, 1);
+    index->filters = index->bits;
+}
+
+// Maps filename and returns true if it holds filters for source with the
+// given block size; anything else means the index has to be rebuilt.
+bool open_block_filter_index(BlockFilterIndex* index, const char* filename, const LogCacheSource* source,
+                             size_t block_size) {
+    memset(index, 0, sizeof(*index));
+    if (!map_file(filename, &index->map)) {
+        return false;
+    }
+
+    BlockFilterHeader header;
+    bool valid = index->map.size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, index->map.data, sizeof(header));
+        uint64_t num_blocks = (source->size + block_size - 1) / block_size;
+        valid = memcmp(header.magic, filter_magic, sizeof(filter_magic)) == 0 && header.version == BLOCK_FILTER_VERSION
+            && header.byte_order == BLOCK_FILTER_BYTE_ORDER && header.source.size == source->size
+            && header.source.mtime == source->mtime && header.source.format_hash == source->format_hash
+            && header.block_size == block_size && header.num_blocks == num_blocks
+            && header.filter_bits == BLOCK_FILTER_BITS && header.num_hashes == BLOCK_FILTER_HASHES
+            && index->map.size == sizeof(header) + filters_size((size_t)num_blocks);
+    }
+    if (!valid) {
+        unmap_file(&index->map);
+        return false;
+    }
+
+    index->filters = (const uint64_t*)(index->map.data + sizeof(header));
+    index->block_size = block_size;
+    index->num_blocks = (size_t)header.num_blocks;
+    return true;
+}
+
+void close_block_filter_index(BlockFilterIndex* index) {
+    free(index->bits);
+    unmap_file(&index->map);
+    memset(index, 0, sizeof(*index));
+}
+
+static const uint64_t* block_filter(const BlockFilterIndex* index, size_t block, BlockFilterField field) {
+    return index->filters + (block * BLOCK_FILTER_FIELDS + field) * BLOCK_FILTER_WORDS;
+}
+
+// Bit positions come from the two halves of the key hash (Kirsch and
+// Mitzenmacher); the step is odd so the positions never repeat early.
+static uint32_t filter_bit(uint64_t hash, int i) {
+    uint32_t first = (uint32_t)hash;
+    uint32_t step = (uint32_t)(hash >> 32) | 1;
+    return (first + (uint32_t)i * step) & (BLOCK_FILTER_BITS - 1);
+}
+
+// offset is where the line starts; only the worker that owns that block
+// may call this.
+void block_filter_add(BlockFilterIndex* index, size_t offset, BlockFilterField field, uint64_t hash) {
+    uint64_t* filter = (uint64_t*)block_filter(index, offset / index->block_size, field);
+    for (int i = 0; i < BLOCK_FILTER_HASHES; i++) {
+        uint32_t bit = filter_bit(hash, i);
+        filter[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+// False only if no line starting in [start_offset, end_offset) can have the
+// key. The range may cover several blocks of the index, e.g. when a -start
+// window shifted the scheduler's blocks against the file.
+bool block_filter_may_contain(const BlockFilterIndex* index, size_t start_offset, size_t end_offset,
+                              BlockFilterField field, uint64_t hash) {
+    if (start_offset >= end_offset) {
+        return false;
+    }
+
+    size_t last_block = (end_offset - 1) / index->block_size;
+    for (size_t block = start_offset / index->block_size; block <= last_block && block < index->num_blocks; block++) {
+        const uint64_t* filter = block_filter(index, block, field);
+        bool present = true;
+        for (int i = 0; i < BLOCK_FILTER_HASHES && present; i++) {
+            uint32_t bit = filter_bit(hash, i);
+            present = (filter[bit / 64] >> (bit % 64)) & 1;
+        }
+        if (present) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Written under a temporary name and renamed, like the cache.
+bool write_block_filter_index(const BlockFilterIndex* index, const char* filename, const LogCacheSource* source) {
+    BlockFilterHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, filter_magic, sizeof(filter_magic));
+    header.version = BLOCK_FILTER_VERSION;
+    header.byte_order = BLOCK_FILTER_BYTE_ORDER;
+    header.source = *source;
+    header.block_size = index->block_size;
+    header.num_blocks = index->num_blocks;
+    header.filter_bits = BLOCK_FILTER_BITS;
+    header.num_hashes = BLOCK_FILTER_HASHES;
+
+    size_t name_len = strlen(filename);
+    char* temp_filename = (char*)malloc(name_len + 5);
+    memcpy(temp_filename, filename, name_len);
+    memcpy(temp_filename + name_len, ".tmp", 5);
+
+    bool ok = false;
+    FILE* file = fopen(temp_filename, "wb");
+    if (file != NULL) {
+        size_t size = filters_size(index->num_blocks);
+        ok = fwrite(&header, sizeof(header), 1, file) == 1
+            && (size == 0 || fwrite(index->filters, 1, size, file) == size);
+        ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+        if (ok) {
+            remove(filename);
+        }
+#endif
+        ok = ok && rename(temp_filename, filename) == 0;
+        if (!ok) {
+            remove(temp_filename);
+        }
+    }
+
+    free(temp_filename);
+    return ok;
+}
@@ -0,0 +1,48 @@
+#ifndef BLOCK_FILTER_H
+#define BLOCK_FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_map.h"
+#include "log_cache.h"
+
+#define BLOCK_FILTER_SUFFIX ".hpbloom"
+// Bits per Bloom filter; a 1 MB block holds about 10 000 lines, and with
+// 5 hash functions a filter of 5 000 distinct keys gives ~0.3% false
+// positives.
+#define BLOCK_FILTER_BITS (1 << 16)
+#define BLOCK_FILTER_WORDS (BLOCK_FILTER_BITS / 64)
+#define BLOCK_FILTER_HASHES 5
+
+typedef enum {
+    BLOCK_FILTER_IP,
+    BLOCK_FILTER_URL,
+    BLOCK_FILTER_FIELDS
+} BlockFilterField;
+
+// One Bloom filter per field for every block_size bytes of the log, over
+// the hashes of the client fields and raw URLs of the lines that start in
+// the block. Built by the workers of a full scan, each writing only the
+// blocks it owns; loaded read-only from the sidecar file afterwards.
+typedef struct BlockFilterIndex {
+    FileMap map;
+    // Owned while building, NULL when loaded.
+    uint64_t* bits;
+    // num_blocks * BLOCK_FILTER_FIELDS filters of BLOCK_FILTER_WORDS each.
+    const uint64_t* filters;
+    size_t block_size;
+    size_t num_blocks;
+} BlockFilterIndex;
+
+void init_block_filter_index(BlockFilterIndex* index, size_t data_size, size_t block_size);
+bool open_block_filter_index(BlockFilterIndex* index, const char* filename, const LogCacheSource* source,
+                             size_t block_size);
+void close_block_filter_index(BlockFilterIndex* index);
+void block_filter_add(BlockFilterIndex* index, size_t offset, BlockFilterField field, uint64_t hash);
+bool block_filter_may_contain(const BlockFilterIndex* index, size_t start_offset, size_t end_offset,
+                              BlockFilterField field, uint64_t hash);
+bool write_block_filter_index(const BlockFilterIndex* index, const char* filename, const LogCacheSource* source);
+
+#endif
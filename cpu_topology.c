@@ -0,0 +1,86 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#include "cpu_topology.h"
+
+// Fills cpus with the ids of the CPUs this process may run on and returns
+// how many there are (at most max_cpus).
+int get_allowed_cpus(int* cpus, int max_cpus) {
+    int count = 0;
+
+#if defined(_WIN32)
+    DWORD_PTR process_mask, system_mask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+        for (int cpu = 0; cpu < (int)(sizeof(DWORD_PTR) * 8) && count < max_cpus; cpu++) {
+            if (process_mask & ((DWORD_PTR)1 << cpu)) {
+                cpus[count++] = cpu;
+            }
+        }
+    }
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && count < max_cpus; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus[count++] = cpu;
+            }
+        }
+    }
+#else
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int cpu = 0; cpu < online && count < max_cpus; cpu++) {
+        cpus[count++] = cpu;
+    }
+#endif
+
+    if (count == 0 && max_cpus > 0) {
+        cpus[count++] = 0;
+    }
+    return count;
+}
+
+int detect_cpu_count(void) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+        return CPU_COUNT(&set);
+    }
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (int)online : 1;
+#elif defined(_WIN32)
+    int cpus[sizeof(DWORD_PTR) * 8];
+    return get_allowed_cpus(cpus, (int)(sizeof(cpus) / sizeof(cpus[0])));
+#else
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (int)online : 1;
+#endif
+}
+
+bool pin_current_thread(int cpu) {
+#if defined(_WIN32)
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
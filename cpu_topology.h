@@ -0,0 +1,10 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <stdbool.h>
+
+int get_allowed_cpus(int* cpus, int max_cpus);
+int detect_cpu_count(void);
+bool pin_current_thread(int cpu);
+
+#endif
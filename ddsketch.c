@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "ddsketch.h"
+
+#define DDSKETCH_INITIAL_BINS 8
+// Wide enough for every positive int64_t at 1% accuracy; past that the
+// lowest bins are folded together.
+#define DDSKETCH_MAX_BINS 4096
+#define DDSKETCH_TABLE_INITIAL_CAPACITY 1024
+
+#define DDSKETCH_GAMMA ((1.0 + DDSKETCH_RELATIVE_ACCURACY) / (1.0 - DDSKETCH_RELATIVE_ACCURACY))
+
+void init_ddsketch(DDSketch* sketch) {
+    sketch->bins = NULL;
+    sketch->offset = 0;
+    sketch->num_bins = 0;
+    sketch->zero_count = 0;
+    sketch->count = 0;
+    sketch->min = 0;
+    sketch->max = 0;
+}
+
+void free_ddsketch(DDSketch* sketch) {
+    free(sketch->bins);
+    init_ddsketch(sketch);
+}
+
+static int bin_index(int64_t value) {
+    return (int)ceil(log((double)value) / log(DDSKETCH_GAMMA));
+}
+
+// Midpoint of the bin in relative terms, so any value in it is within the
+// relative accuracy of the result.
+static double bin_value(int index) {
+    return 2.0 * pow(DDSKETCH_GAMMA, index) / (DDSKETCH_GAMMA + 1.0);
+}
+
+// Reallocates the bins so that they reach index. The highest bin is always
+// kept; if the range no longer fits, bins below the new lowest bin are
+// added into it.
+static void grow_bins(DDSketch* sketch, int index) {
+    int low = index < sketch->offset ? index : sketch->offset;
+    int high = sketch->offset + sketch->num_bins - 1;
+    if (index > high) {
+        high = index;
+    }
+
+    int num_bins = sketch->num_bins;
+    while (num_bins < high - low + 1 && num_bins < DDSKETCH_MAX_BINS) {
+        num_bins *= 2;
+    }
+    int offset = high - num_bins + 1 > low ? high - num_bins + 1 : low;
+    if (num_bins == sketch->num_bins && offset == sketch->offset) {
+        return;
+    }
+
+    int64_t* bins = (int64_t*)calloc(num_bins, sizeof(int64_t));
+    for (int i = 0; i < sketch->num_bins; i++) {
+        int target = sketch->offset + i < offset ? 0 : sketch->offset + i - offset;
+        bins[target] += sketch->bins[i];
+    }
+    free(sketch->bins);
+    sketch->bins = bins;
+    sketch->offset = offset;
+    sketch->num_bins = num_bins;
+}
+
+static int64_t* bin_for(DDSketch* sketch, int index) {
+    if (sketch->bins == NULL) {
+        sketch->num_bins = DDSKETCH_INITIAL_BINS;
+        sketch->offset = index - DDSKETCH_INITIAL_BINS / 2;
+        sketch->bins = (int64_t*)calloc(sketch->num_bins, sizeof(int64_t));
+    } else if (index < sketch->offset || index >= sketch->offset + sketch->num_bins) {
+        grow_bins(sketch, index);
+    }
+    return &sketch->bins[index < sketch->offset ? 0 : index - sketch->offset];
+}
+
+static void update_range(DDSketch* sketch, int64_t min, int64_t max) {
+    if (sketch->count == 0 || min < sketch->min) {
+        sketch->min = min;
+    }
+    if (sketch->count == 0 || max > sketch->max) {
+        sketch->max = max;
+    }
+}
+
+// Negative values are ignored.
+void ddsketch_add(DDSketch* sketch, int64_t value) {
+    if (value < 0) {
+        return;
+    }
+
+    update_range(sketch, value, value);
+    sketch->count++;
+
+    if (value == 0) {
+        sketch->zero_count++;
+    } else {
+        (*bin_for(sketch, bin_index(value)))++;
+    }
+}
+
+void ddsketch_merge(DDSketch* dst, const DDSketch* src) {
+    if (src->count == 0) {
+        return;
+    }
+
+    update_range(dst, src->min, src->max);
+    dst->count += src->count;
+    dst->zero_count += src->zero_count;
+
+    if (src->bins != NULL) {
+        // Reaching both ends first means at most one reallocation.
+        bin_for(dst, src->offset);
+        bin_for(dst, src->offset + src->num_bins - 1);
+        for (int i = 0; i < src->num_bins; i++) {
+            if (src->bins[i] != 0) {
+                *bin_for(dst, src->offset + i) += src->bins[i];
+            }
+        }
+    }
+}
+
+// Value at rank q * (count - 1), clamped to the smallest and largest
+// values seen; 0 for an empty sketch.
+double ddsketch_quantile(const DDSketch* sketch, double q) {
+    if (sketch->count == 0) {
+        return 0.0;
+    }
+
+    double rank = q * (double)(sketch->count - 1);
+    int64_t seen = sketch->zero_count;
+    if ((double)seen > rank) {
+        return 0.0;
+    }
+
+    for (int i = 0; i < sketch->num_bins; i++) {
+        seen += sketch->bins[i];
+        if ((double)seen > rank) {
+            double value = bin_value(sketch->offset + i);
+            if (value < (double)sketch->min) {
+                value = (double)sketch->min;
+            }
+            if (value > (double)sketch->max) {
+                value = (double)sketch->max;
+            }
+            return value;
+        }
+    }
+
+    return (double)sketch->max;
+}
+
+void init_ddsketch_table(DDSketchTable* table) {
+    table->capacity = DDSKETCH_TABLE_INITIAL_CAPACITY;
+    table->size = 0;
+    table->hashes = (uint64_t*)calloc(table->capacity, sizeof(uint64_t));
+    table->sketches = (DDSketch*)malloc(table->capacity * sizeof(DDSketch));
+}
+
+void free_ddsketch_table(DDSketchTable* table) {
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->hashes[i] != 0) {
+            free_ddsketch(&table->sketches[i]);
+        }
+    }
+    free(table->hashes);
+    free(table->sketches);
+    table->hashes = NULL;
+    table->sketches = NULL;
+    table->capacity = 0;
+    table->size = 0;
+}
+
+static size_t probe(const uint64_t* hashes, size_t capacity, uint64_t hash) {
+    size_t mask = capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while (hashes[i] != 0 && hashes[i] != hash) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void grow_table(DDSketchTable* table) {
+    size_t capacity = table->capacity * 2;
+    uint64_t* hashes = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+    DDSketch* sketches = (DDSketch*)malloc(capacity * sizeof(DDSketch));
+
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->hashes[i] != 0) {
+            size_t j = probe(hashes, capacity, table->hashes[i]);
+            hashes[j] = table->hashes[i];
+            sketches[j] = table->sketches[i];
+        }
+    }
+
+    free(table->hashes);
+    free(table->sketches);
+    table->hashes = hashes;
+    table->sketches = sketches;
+    table->capacity = capacity;
+}
+
+// Returns the sketch for hash, creating an empty one if needed.
+static DDSketch* find_or_insert(DDSketchTable* table, uint64_t hash) {
+    if ((table->size + 1) * 2 > table->capacity) {
+        grow_table(table);
+    }
+
+    size_t i = probe(table->hashes, table->capacity, hash);
+    if (table->hashes[i] == 0) {
+        table->hashes[i] = hash;
+        init_ddsketch(&table->sketches[i]);
+        table->size++;
+    }
+    return &table->sketches[i];
+}
+
+void ddsketch_table_add(DDSketchTable* table, uint64_t hash, int64_t value) {
+    ddsketch_add(find_or_insert(table, hash), value);
+}
+
+// Sketches that dst does not have yet are moved over instead of copied;
+// src is left empty but still has to be freed.
+void ddsketch_table_merge(DDSketchTable* dst, DDSketchTable* src) {
+    for (size_t i = 0; i < src->capacity; i++) {
+        if (src->hashes[i] == 0) {
+            continue;
+        }
+        DDSketch* sketch = find_or_insert(dst, src->hashes[i]);
+        if (sketch->count == 0) {
+            free_ddsketch(sketch);
+            *sketch = src->sketches[i];
+            init_ddsketch(&src->sketches[i]);
+        } else {
+            ddsketch_merge(sketch, &src->sketches[i]);
+        }
+    }
+}
+
+const DDSketch* ddsketch_table_find(const DDSketchTable* table, uint64_t hash) {
+    size_t i = probe(table->hashes, table->capacity, hash);
+    return table->hashes[i] != 0 ? &table->sketches[i] : NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef DDSKETCH_H
+#define DDSKETCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every quantile is reported within this relative error of a value that
+// was actually seen.
+#define DDSKETCH_RELATIVE_ACCURACY 0.01
+
+// Quantile sketch over non-negative integers (DDSketch). Positive values
+// are counted in logarithmic bins; bin i holds values in
+// (gamma^(i-1), gamma^i] with gamma = (1 + a) / (1 - a). Only the range of
+// bins seen so far is allocated, so sketches of similar values stay small.
+typedef struct {
+    int64_t* bins;
+    int offset;
+    int num_bins;
+    int64_t zero_count;
+    int64_t count;
+    int64_t min;
+    int64_t max;
+} DDSketch;
+
+// One sketch per 64-bit key hash; a hash of 0 marks an empty slot. The
+// key text itself is not kept, callers look sketches up by the hash they
+// already store alongside the key.
+typedef struct {
+    uint64_t* hashes;
+    DDSketch* sketches;
+    size_t capacity;
+    size_t size;
+} DDSketchTable;
+
+void init_ddsketch(DDSketch* sketch);
+void free_ddsketch(DDSketch* sketch);
+void ddsketch_add(DDSketch* sketch, int64_t value);
+void ddsketch_merge(DDSketch* dst, const DDSketch* src);
+double ddsketch_quantile(const DDSketch* sketch, double q);
+
+void init_ddsketch_table(DDSketchTable* table);
+void free_ddsketch_table(DDSketchTable* table);
+void ddsketch_table_add(DDSketchTable* table, uint64_t hash, int64_t value);
+void ddsketch_table_merge(DDSketchTable* dst, DDSketchTable* src);
+const DDSketch* ddsketch_table_find(const DDSketchTable* table, uint64_t hash);
+
+#endif
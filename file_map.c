@@ -0,0 +1,184 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "file_map.h"
+
+// Used when the file cannot be mapped (pipes, special files): the whole
+// contents are read into a heap buffer so workers still see one flat span.
+static bool read_whole_file(const char* filename, FileMap* map) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    size_t capacity = 1 << 20;
+    size_t size = 0;
+    char* buffer = (char*)malloc(capacity);
+    if (buffer == NULL) {
+        fclose(file);
+        errno = ENOMEM;
+        return false;
+    }
+
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer + size, 1, capacity - size, file)) > 0) {
+        size += bytes_read;
+        if (size == capacity) {
+            char* grown = (char*)realloc(buffer, capacity * 2);
+            if (grown == NULL) {
+                free(buffer);
+                fclose(file);
+                errno = ENOMEM;
+                return false;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+    }
+
+    fclose(file);
+    if (size == 0) {
+        free(buffer);
+        map->data = "";
+        return true;
+    }
+
+    map->data = buffer;
+    map->size = size;
+    map->mapped = false;
+    return true;
+}
+
+#ifdef _WIN32
+
+bool map_file(const char* filename, FileMap* map) {
+    memset(map, 0, sizeof(*map));
+
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size)) {
+        CloseHandle(file);
+        return read_whole_file(filename, map);
+    }
+
+    if (file_size.QuadPart == 0) {
+        CloseHandle(file);
+        map->data = "";
+        return true;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return read_whole_file(filename, map);
+    }
+
+    const char* data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return read_whole_file(filename, map);
+    }
+
+    map->data = data;
+    map->size = (size_t)file_size.QuadPart;
+    map->mapped = true;
+    map->file_handle = file;
+    map->mapping_handle = mapping;
+    return true;
+}
+
+void unmap_file(FileMap* map) {
+    if (map->mapped) {
+        UnmapViewOfFile(map->data);
+        CloseHandle(map->mapping_handle);
+        CloseHandle(map->file_handle);
+    } else if (map->size > 0) {
+        free((void*)map->data);
+    }
+    memset(map, 0, sizeof(*map));
+}
+
+void advise_file_range(const FileMap* map, size_t start_offset, size_t end_offset) {
+    (void)map;
+    (void)start_offset;
+    (void)end_offset;
+}
+
+#else
+
+bool map_file(const char* filename, FileMap* map) {
+    memset(map, 0, sizeof(*map));
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return read_whole_file(filename, map);
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        map->data = "";
+        return true;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return read_whole_file(filename, map);
+    }
+
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    map->data = (const char*)data;
+    map->size = (size_t)st.st_size;
+    map->mapped = true;
+    return true;
+}
+
+void unmap_file(FileMap* map) {
+    if (map->mapped) {
+        munmap((void*)map->data, map->size);
+    } else if (map->size > 0) {
+        free((void*)map->data);
+    }
+    memset(map, 0, sizeof(*map));
+}
+
+// Asks the kernel to start reading a worker's span ahead of the scan.
+void advise_file_range(const FileMap* map, size_t start_offset, size_t end_offset) {
+    if (!map->mapped || start_offset >= end_offset) {
+        return;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t aligned_start = start_offset - start_offset % (size_t)page_size;
+    madvise((char*)map->data + aligned_start, end_offset - aligned_start, MADV_WILLNEED);
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    const char* data;
+    size_t size;
+    bool mapped;
+#ifdef _WIN32
+    void* file_handle;
+    void* mapping_handle;
+#endif
+} FileMap;
+
+bool map_file(const char* filename, FileMap* map);
+void unmap_file(FileMap* map);
+void advise_file_range(const FileMap* map, size_t start_offset, size_t end_offset);
+
+#endif
@@ -0,0 +1,651 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "filter_expr.h"
+#include "scanner.h"
+
+static const char* field_names[FILTER_FIELDS] = {"ip", "method", "url", "referer", "ua", "code", "class", "hour",
+                                                  "size"};
+
+static bool is_numeric_field(FilterField field) {
+    return field >= FILTER_FIELD_CODE;
+}
+
+typedef enum {
+    FILTER_NODE_COMPARE,
+    FILTER_NODE_CONST,
+    FILTER_NODE_NOT,
+    FILTER_NODE_AND,
+    FILTER_NODE_OR
+} FilterNodeKind;
+
+// Syntax tree built by the parser and simplified before code is emitted.
+// Nodes refer to each other by index, since the array grows while parsing;
+// an && or || node has a list of operands linked through next.
+typedef struct {
+    FilterNodeKind kind;
+    FilterInstruction leaf;
+    int child;
+    int next;
+    int cost;
+} FilterNode;
+
+typedef struct {
+    const char* text;
+    const char* pos;
+    FilterNode* nodes;
+    int num_nodes;
+    int capacity;
+    char* strings;
+    size_t strings_len;
+    const char* error;
+    const char* error_pos;
+} FilterParser;
+
+typedef enum {
+    OPERAND_FIELD,
+    OPERAND_NUMBER,
+    OPERAND_STRING
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    FilterField field;
+    double number;
+    const char* text;
+    size_t text_len;
+} Operand;
+
+static int fail(FilterParser* parser, const char* message) {
+    if (parser->error == NULL) {
+        parser->error = message;
+        parser->error_pos = parser->pos;
+    }
+    return -1;
+}
+
+static int new_node(FilterParser* parser, FilterNodeKind kind) {
+    if (parser->num_nodes == parser->capacity) {
+        parser->capacity = parser->capacity > 0 ? parser->capacity * 2 : 16;
+        parser->nodes = (FilterNode*)realloc(parser->nodes, parser->capacity * sizeof(FilterNode));
+    }
+    FilterNode* node = &parser->nodes[parser->num_nodes];
+    memset(node, 0, sizeof(*node));
+    node->kind = kind;
+    node->child = -1;
+    node->next = -1;
+    return parser->num_nodes++;
+}
+
+static void skip_spaces(FilterParser* parser) {
+    while (*parser->pos == ' ' || *parser->pos == '\t' || *parser->pos == '\n' || *parser->pos == '\r') {
+        parser->pos++;
+    }
+}
+
+static bool match(FilterParser* parser, const char* token) {
+    skip_spaces(parser);
+    size_t len = strlen(token);
+    if (strncmp(parser->pos, token, len) != 0) {
+        return false;
+    }
+    parser->pos += len;
+    return true;
+}
+
+static bool is_name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static bool parse_operand(FilterParser* parser, Operand* operand) {
+    skip_spaces(parser);
+    const char* start = parser->pos;
+    char c = *start;
+
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') {
+        const char* end = start;
+        while (is_name_char(*end)) {
+            end++;
+        }
+        for (int field = 0; field < FILTER_FIELDS; field++) {
+            if (strlen(field_names[field]) == (size_t)(end - start)
+                && strncmp(field_names[field], start, end - start) == 0) {
+                operand->kind = OPERAND_FIELD;
+                operand->field = (FilterField)field;
+                parser->pos = end;
+                return true;
+            }
+        }
+        fail(parser, "unknown field");
+        return false;
+    }
+
+    if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.') {
+        char* end;
+        operand->number = strtod(start, &end);
+        if (end == start || is_name_char(*end)) {
+            fail(parser, "invalid number");
+            return false;
+        }
+        operand->kind = OPERAND_NUMBER;
+        parser->pos = end;
+        return true;
+    }
+
+    if (c == '"' || c == '\'') {
+        const char* p = start + 1;
+        char* out = parser->strings + parser->strings_len;
+        size_t len = 0;
+        while (*p != c) {
+            if (*p == '\0') {
+                fail(parser, "unterminated string");
+                return false;
+            }
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+            out[len++] = *p++;
+        }
+        out[len] = '\0';
+        parser->strings_len += len + 1;
+        operand->kind = OPERAND_STRING;
+        operand->text = out;
+        operand->text_len = len;
+        parser->pos = p + 1;
+        return true;
+    }
+
+    fail(parser, "expected a field, number or string");
+    return false;
+}
+
+static bool compare_numbers(double a, FilterCompare compare, double b) {
+    switch (compare) {
+        case FILTER_EQ: return a == b;
+        case FILTER_NE: return a != b;
+        case FILTER_LT: return a < b;
+        case FILTER_LE: return a <= b;
+        case FILTER_GT: return a > b;
+        case FILTER_GE: return a >= b;
+        default: return false;
+    }
+}
+
+static bool compare_strings(const char* a, size_t a_len, FilterCompare compare, const char* b, size_t b_len) {
+    switch (compare) {
+        case FILTER_EQ:
+            return a_len == b_len && memcmp(a, b, a_len) == 0;
+        case FILTER_NE:
+            return a_len != b_len || memcmp(a, b, a_len) != 0;
+        case FILTER_PREFIX:
+            return a_len >= b_len && memcmp(a, b, b_len) == 0;
+        case FILTER_SUFFIX:
+            return a_len >= b_len && memcmp(a + a_len - b_len, b, b_len) == 0;
+        case FILTER_CONTAINS:
+            return scan_find_literal(a, a + a_len, b, b_len) != a + a_len || b_len == 0;
+        default:
+            break;
+    }
+
+    int order = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (order == 0) {
+        order = a_len < b_len ? -1 : a_len > b_len;
+    }
+    return compare_numbers(order, compare, 0);
+}
+
+// Operators, longest first so that "<=" is not read as "<".
+static const struct {
+    const char* token;
+    FilterCompare compare;
+} compare_tokens[] = {
+    {"==", FILTER_EQ}, {"!=", FILTER_NE}, {"<=", FILTER_LE}, {">=", FILTER_GE}, {"^=", FILTER_PREFIX},
+    {"$=", FILTER_SUFFIX}, {"*=", FILTER_CONTAINS}, {"<", FILTER_LT}, {">", FILTER_GT},
+};
+
+// field <op> literal, literal <op> field or literal <op> literal, which is
+// folded into a constant.
+static int parse_comparison(FilterParser* parser) {
+    Operand left;
+    Operand right;
+    if (!parse_operand(parser, &left)) {
+        return -1;
+    }
+
+    int op = -1;
+    for (size_t i = 0; i < sizeof(compare_tokens) / sizeof(compare_tokens[0]) && op < 0; i++) {
+        if (match(parser, compare_tokens[i].token)) {
+            op = (int)i;
+        }
+    }
+    if (op < 0) {
+        return fail(parser, "expected a comparison operator");
+    }
+    FilterCompare compare = compare_tokens[op].compare;
+    bool ordered = compare != FILTER_PREFIX && compare != FILTER_SUFFIX && compare != FILTER_CONTAINS;
+
+    if (!parse_operand(parser, &right)) {
+        return -1;
+    }
+
+    if (left.kind != OPERAND_FIELD && right.kind == OPERAND_FIELD) {
+        if (!ordered) {
+            return fail(parser, "the field must come first");
+        }
+        Operand swap = left;
+        left = right;
+        right = swap;
+        if (compare == FILTER_LT || compare == FILTER_GT) {
+            compare = compare == FILTER_LT ? FILTER_GT : FILTER_LT;
+        } else if (compare == FILTER_LE || compare == FILTER_GE) {
+            compare = compare == FILTER_LE ? FILTER_GE : FILTER_LE;
+        }
+    }
+    if (right.kind == OPERAND_FIELD) {
+        return fail(parser, "cannot compare two fields");
+    }
+
+    if (left.kind != OPERAND_FIELD) {
+        if (left.kind != right.kind || (left.kind == OPERAND_NUMBER && !ordered)) {
+            return fail(parser, "mismatched operand types");
+        }
+        int node = new_node(parser, FILTER_NODE_CONST);
+        parser->nodes[node].leaf.value = left.kind == OPERAND_NUMBER
+            ? compare_numbers(left.number, compare, right.number)
+            : compare_strings(left.text, left.text_len, compare, right.text, right.text_len);
+        return node;
+    }
+
+    if (is_numeric_field(left.field) != (right.kind == OPERAND_NUMBER)) {
+        return fail(parser, is_numeric_field(left.field) ? "the field is a number" : "the field is a string");
+    }
+    if (right.kind == OPERAND_NUMBER && !ordered) {
+        return fail(parser, "string operator applied to a number");
+    }
+
+    int node = new_node(parser, FILTER_NODE_COMPARE);
+    FilterInstruction* leaf = &parser->nodes[node].leaf;
+    leaf->field = left.field;
+    leaf->compare = compare;
+    if (right.kind == OPERAND_NUMBER) {
+        leaf->opcode = FILTER_OP_NUMBER;
+        leaf->number = right.number;
+        return node;
+    }
+
+    // An address or CIDR block compared to the client field matches every
+    // spelling of the addresses it covers.
+    if (left.field == FILTER_FIELD_IP && (compare == FILTER_EQ || compare == FILTER_NE)
+        && parse_ip_range(right.text, right.text_len, &leaf->range)) {
+        leaf->opcode = FILTER_OP_IP_RANGE;
+        if (compare == FILTER_NE) {
+            int negation = new_node(parser, FILTER_NODE_NOT);
+            parser->nodes[negation].child = node;
+            return negation;
+        }
+        return node;
+    }
+
+    leaf->opcode = FILTER_OP_STRING;
+    leaf->text = right.text;
+    leaf->text_len = right.text_len;
+    return node;
+}
+
+static int parse_or(FilterParser* parser);
+
+static int parse_unary(FilterParser* parser) {
+    skip_spaces(parser);
+    if (parser->pos[0] == '!' && parser->pos[1] != '=') {
+        parser->pos++;
+        int child = parse_unary(parser);
+        if (child < 0) {
+            return -1;
+        }
+        int node = new_node(parser, FILTER_NODE_NOT);
+        parser->nodes[node].child = child;
+        return node;
+    }
+
+    if (match(parser, "(")) {
+        int node = parse_or(parser);
+        if (node >= 0 && !match(parser, ")")) {
+            return fail(parser, "expected ')'");
+        }
+        return node;
+    }
+
+    return parse_comparison(parser);
+}
+
+static int parse_list(FilterParser* parser, FilterNodeKind kind, const char* token, int (*parse_operand_node)(FilterParser*)) {
+    int first = parse_operand_node(parser);
+    if (first < 0 || !match(parser, token)) {
+        return first;
+    }
+
+    int node = new_node(parser, kind);
+    parser->nodes[node].child = first;
+    int last = first;
+    do {
+        int next = parse_operand_node(parser);
+        if (next < 0) {
+            return -1;
+        }
+        parser->nodes[last].next = next;
+        last = next;
+    } while (match(parser, token));
+    return node;
+}
+
+static int parse_and(FilterParser* parser) {
+    return parse_list(parser, FILTER_NODE_AND, "&&", parse_unary);
+}
+
+static int parse_or(FilterParser* parser) {
+    return parse_list(parser, FILTER_NODE_OR, "||", parse_and);
+}
+
+// Rough cost of evaluating a test: numbers are read straight from the
+// record, strings have to be compared byte by byte.
+static int leaf_cost(const FilterInstruction* leaf) {
+    switch (leaf->opcode) {
+        case FILTER_OP_NUMBER:
+            return leaf->field == FILTER_FIELD_HOUR ? 2 : 1;
+        case FILTER_OP_IP_RANGE:
+            return 2;
+        default:
+            return leaf->compare == FILTER_CONTAINS ? 8 : 4;
+    }
+}
+
+static void make_const(FilterNode* node, bool value) {
+    node->kind = FILTER_NODE_CONST;
+    node->leaf.value = value;
+    node->child = -1;
+    node->cost = 0;
+}
+
+// Folds constants, removes double negations, flattens nested && and ||
+// and orders their operands cheapest first, so that numeric tests decide
+// a line before any string is compared. Returns the node that replaces
+// index.
+static int simplify(FilterParser* parser, int index) {
+    FilterNode* node = &parser->nodes[index];
+    switch (node->kind) {
+        case FILTER_NODE_COMPARE:
+            node->cost = leaf_cost(&node->leaf);
+            return index;
+        case FILTER_NODE_CONST:
+            node->cost = 0;
+            return index;
+        case FILTER_NODE_NOT: {
+            int child = simplify(parser, node->child);
+            FilterNode* child_node = &parser->nodes[child];
+            if (child_node->kind == FILTER_NODE_CONST) {
+                make_const(node, !child_node->leaf.value);
+                return index;
+            }
+            if (child_node->kind == FILTER_NODE_NOT) {
+                return child_node->child;
+            }
+            node->child = child;
+            node->cost = child_node->cost;
+            return index;
+        }
+        default:
+            break;
+    }
+
+    // For &&, a false operand decides the result and a true one can be
+    // dropped; the other way round for ||.
+    FilterNodeKind kind = node->kind;
+    bool deciding = kind == FILTER_NODE_OR;
+    int num_pending = 0;
+    for (int child = node->child; child >= 0; child = parser->nodes[child].next) {
+        num_pending++;
+    }
+    int* pending = (int*)malloc(num_pending * sizeof(int));
+    num_pending = 0;
+    for (int child = node->child; child >= 0; child = parser->nodes[child].next) {
+        pending[num_pending++] = child;
+    }
+
+    // Operands of the same kind are already flat after simplifying, so
+    // their own operands are taken over one level deep.
+    bool decided = false;
+    int num_operands = 0;
+    for (int i = 0; i < num_pending && !decided; i++) {
+        pending[i] = simplify(parser, pending[i]);
+        const FilterNode* child_node = &parser->nodes[pending[i]];
+        if (child_node->kind == FILTER_NODE_CONST) {
+            decided = child_node->leaf.value == deciding;
+        } else if (child_node->kind == kind) {
+            for (int grandchild = child_node->child; grandchild >= 0; grandchild = parser->nodes[grandchild].next) {
+                num_operands++;
+            }
+        } else {
+            num_operands++;
+        }
+    }
+
+    int* operands = (int*)malloc((num_operands > 0 ? num_operands : 1) * sizeof(int));
+    num_operands = 0;
+    for (int i = 0; i < num_pending && !decided; i++) {
+        const FilterNode* child_node = &parser->nodes[pending[i]];
+        if (child_node->kind == FILTER_NODE_CONST) {
+            continue;
+        }
+        if (child_node->kind == kind) {
+            for (int grandchild = child_node->child; grandchild >= 0; grandchild = parser->nodes[grandchild].next) {
+                operands[num_operands++] = grandchild;
+            }
+        } else {
+            operands[num_operands++] = pending[i];
+        }
+    }
+    free(pending);
+
+    node = &parser->nodes[index];
+    if (decided || num_operands == 0) {
+        make_const(node, decided ? deciding : !deciding);
+        free(operands);
+        return index;
+    }
+    if (num_operands == 1) {
+        int only = operands[0];
+        free(operands);
+        return only;
+    }
+
+    // Stable, so tests of equal cost keep the order they were written in.
+    for (int i = 1; i < num_operands; i++) {
+        int operand = operands[i];
+        int j = i;
+        while (j > 0 && parser->nodes[operands[j - 1]].cost > parser->nodes[operand].cost) {
+            operands[j] = operands[j - 1];
+            j--;
+        }
+        operands[j] = operand;
+    }
+
+    node->child = operands[0];
+    node->cost = 0;
+    for (int i = 0; i < num_operands; i++) {
+        parser->nodes[operands[i]].next = i + 1 < num_operands ? operands[i + 1] : -1;
+        node->cost += parser->nodes[operands[i]].cost;
+    }
+    free(operands);
+    return index;
+}
+
+static size_t emit(FilterExpr* expr, size_t* capacity, const FilterInstruction* instruction) {
+    if (expr->length == *capacity) {
+        *capacity = *capacity > 0 ? *capacity * 2 : 16;
+        expr->code = (FilterInstruction*)realloc(expr->code, *capacity * sizeof(FilterInstruction));
+    }
+    expr->code[expr->length] = *instruction;
+    return expr->length++;
+}
+
+static void emit_node(FilterParser* parser, int index, FilterExpr* expr, size_t* capacity) {
+    const FilterNode* node = &parser->nodes[index];
+    FilterInstruction instruction;
+    memset(&instruction, 0, sizeof(instruction));
+
+    switch (node->kind) {
+        case FILTER_NODE_COMPARE:
+            emit(expr, capacity, &node->leaf);
+            break;
+        case FILTER_NODE_CONST:
+            instruction.opcode = FILTER_OP_CONST;
+            instruction.value = node->leaf.value;
+            emit(expr, capacity, &instruction);
+            break;
+        case FILTER_NODE_NOT:
+            emit_node(parser, node->child, expr, capacity);
+            instruction.opcode = FILTER_OP_NOT;
+            emit(expr, capacity, &instruction);
+            break;
+        case FILTER_NODE_AND:
+        case FILTER_NODE_OR: {
+            // Every jump goes to the end of the list, where the result that
+            // triggered it is the result of the whole list. Jumps of nested
+            // lists are of the other kind or already have their target.
+            size_t first_jump = expr->length;
+            instruction.opcode = node->kind == FILTER_NODE_AND ? FILTER_OP_JUMP_IF_FALSE : FILTER_OP_JUMP_IF_TRUE;
+            for (int child = node->child; child >= 0; child = parser->nodes[child].next) {
+                emit_node(parser, child, expr, capacity);
+                if (parser->nodes[child].next >= 0) {
+                    emit(expr, capacity, &instruction);
+                }
+            }
+            for (size_t i = first_jump; i < expr->length; i++) {
+                if (expr->code[i].opcode == instruction.opcode && expr->code[i].target == 0) {
+                    expr->code[i].target = expr->length;
+                }
+            }
+            break;
+        }
+    }
+}
+
+// Compiles text, printing the reason and returning false if it is not a
+// valid expression.
+bool compile_filter_expr(FilterExpr* expr, const char* text) {
+    memset(expr, 0, sizeof(*expr));
+
+    FilterParser parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.text = text;
+    parser.pos = text;
+    // Unescaped literals are never longer than the text they come from.
+    parser.strings = (char*)malloc(strlen(text) + 1);
+
+    int root = parse_or(&parser);
+    skip_spaces(&parser);
+    if (root >= 0 && *parser.pos != '\0') {
+        root = fail(&parser, "unexpected text");
+    }
+    if (root < 0) {
+        fprintf(stderr, "Error: %s at position %d of '%s'\n", parser.error, (int)(parser.error_pos - text) + 1,
+                text);
+        free(parser.nodes);
+        free(parser.strings);
+        return false;
+    }
+
+    root = simplify(&parser, root);
+    size_t capacity = 0;
+    emit_node(&parser, root, expr, &capacity);
+    expr->strings = parser.strings;
+    free(parser.nodes);
+    return true;
+}
+
+void free_filter_expr(FilterExpr* expr) {
+    free(expr->code);
+    free(expr->strings);
+    memset(expr, 0, sizeof(*expr));
+}
+
+// False when the record has no value for the field, such as the hour of a
+// line whose timestamp could not be parsed.
+static bool record_number(const LogRecord* record, FilterField field, double* value) {
+    int code = record->entry.code;
+    switch (field) {
+        case FILTER_FIELD_CODE:
+            *value = code;
+            return true;
+        case FILTER_FIELD_CLASS:
+            *value = code >= 100 && code < 600 ? code / 100 : 0;
+            return true;
+        case FILTER_FIELD_HOUR:
+            *value = record->has_time ? log_time_hour(&record->time) : 0;
+            return record->has_time;
+        case FILTER_FIELD_SIZE:
+            *value = (double)record->entry.size;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static StrSpan record_string(const LogRecord* record, FilterField field) {
+    switch (field) {
+        case FILTER_FIELD_IP: return record->entry.ip;
+        case FILTER_FIELD_METHOD: return record->entry.method;
+        case FILTER_FIELD_URL: return record->entry.url;
+        case FILTER_FIELD_REFERER: return record->entry.referer;
+        default: return record->entry.useragent;
+    }
+}
+
+// Reads only the fields the instructions on the taken path test; strings
+// are compared in place in the line or cache.
+bool filter_expr_matches(const FilterExpr* expr, const LogRecord* record) {
+    bool result = true;
+    size_t pc = 0;
+    while (pc < expr->length) {
+        const FilterInstruction* instruction = &expr->code[pc++];
+        switch (instruction->opcode) {
+            case FILTER_OP_NUMBER: {
+                double value;
+                result = record_number(record, instruction->field, &value)
+                    && compare_numbers(value, instruction->compare, instruction->number);
+                break;
+            }
+            case FILTER_OP_STRING: {
+                StrSpan value = record_string(record, instruction->field);
+                result = compare_strings(value.ptr != NULL ? value.ptr : "", value.len, instruction->compare,
+                                         instruction->text, instruction->text_len);
+                break;
+            }
+            case FILTER_OP_IP_RANGE:
+                result = record->ip_is_address && ip_range_contains(&instruction->range, &record->ip_key);
+                break;
+            case FILTER_OP_CONST:
+                result = instruction->value;
+                break;
+            case FILTER_OP_NOT:
+                result = !result;
+                break;
+            case FILTER_OP_JUMP_IF_FALSE:
+                if (!result) {
+                    pc = instruction->target;
+                }
+                break;
+            case FILTER_OP_JUMP_IF_TRUE:
+                if (result) {
+                    pc = instruction->target;
+                }
+                break;
+        }
+    }
+    return result;
+}
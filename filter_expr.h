@@ -0,0 +1,75 @@
+#ifndef FILTER_EXPR_H
+#define FILTER_EXPR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "log_analyzer.h"
+#include "ip_set.h"
+
+// Fields an expression can test; names follow -groupby, plus size.
+typedef enum {
+    FILTER_FIELD_IP,
+    FILTER_FIELD_METHOD,
+    FILTER_FIELD_URL,
+    FILTER_FIELD_REFERER,
+    FILTER_FIELD_USERAGENT,
+    FILTER_FIELD_CODE,
+    FILTER_FIELD_CLASS,
+    FILTER_FIELD_HOUR,
+    FILTER_FIELD_SIZE,
+    FILTER_FIELDS
+} FilterField;
+
+typedef enum {
+    FILTER_OP_NUMBER,    // result = field <compare> number
+    FILTER_OP_STRING,    // result = field <compare> text
+    FILTER_OP_IP_RANGE,  // result = client address within range
+    FILTER_OP_CONST,     // result = value
+    FILTER_OP_NOT,       // result = !result
+    FILTER_OP_JUMP_IF_FALSE,
+    FILTER_OP_JUMP_IF_TRUE
+} FilterOpcode;
+
+typedef enum {
+    FILTER_EQ,
+    FILTER_NE,
+    FILTER_LT,
+    FILTER_LE,
+    FILTER_GT,
+    FILTER_GE,
+    FILTER_PREFIX,   // ^=
+    FILTER_SUFFIX,   // $=
+    FILTER_CONTAINS  // *=
+} FilterCompare;
+
+typedef struct {
+    FilterOpcode opcode;
+    FilterField field;
+    FilterCompare compare;
+    bool value;
+    // Jump destination.
+    size_t target;
+    double number;
+    const char* text;
+    size_t text_len;
+    IpRange range;
+} FilterInstruction;
+
+// A -where expression compiled to instructions on a single boolean result:
+// && and || become conditional jumps over the right operand, so evaluation
+// stops as soon as the outcome is known. Read-only once compiled, so all
+// workers share one.
+typedef struct FilterExpr {
+    FilterInstruction* code;
+    size_t length;
+    // Unescaped string literals, which instructions point into.
+    char* strings;
+} FilterExpr;
+
+bool compile_filter_expr(FilterExpr* expr, const char* text);
+void free_filter_expr(FilterExpr* expr);
+bool filter_expr_matches(const FilterExpr* expr, const LogRecord* record);
+
+#endif
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hash_table.h"
+#include "top_n.h"
+
+#define COUNTER_TABLE_INITIAL_CAPACITY 1024
+#define COUNTER_TABLE_MIGRATE_STEP 16
+#define KEY_ARENA_BLOCK_SIZE (64 * 1024)
+
+// Keys are copied into large blocks instead of one malloc per key.
+struct KeyArenaBlock {
+    KeyArenaBlock* next;
+    size_t capacity;
+    size_t used;
+    char data[];
+};
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t hash_bytes(const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ ((uint64_t)len * 0xC2B2AE3D27D4EB4FULL);
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        h ^= word * 0xC2B2AE3D27D4EB4FULL;
+        h = rotl64(h, 31) * 0x9E3779B97F4A7C15ULL;
+        p += 8;
+        len -= 8;
+    }
+
+    if (len > 0) {
+        uint64_t word = 0;
+        memcpy(&word, p, len);
+        h ^= word * 0x165667B19E3779F9ULL;
+        h = rotl64(h, 27) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+
+    return h != 0 ? h : 1;
+}
+
+static char* arena_copy(CounterTable* table, const char* key, size_t key_len) {
+    KeyArenaBlock* block = table->arena;
+    if (block == NULL || block->capacity - block->used < key_len + 1) {
+        size_t capacity = key_len + 1 > KEY_ARENA_BLOCK_SIZE ? key_len + 1 : KEY_ARENA_BLOCK_SIZE;
+        block = (KeyArenaBlock*)malloc(sizeof(KeyArenaBlock) + capacity);
+        block->next = table->arena;
+        block->capacity = capacity;
+        block->used = 0;
+        table->arena = block;
+    }
+
+    char* copy = block->data + block->used;
+    memcpy(copy, key, key_len);
+    copy[key_len] = '\0';
+    block->used += key_len + 1;
+    return copy;
+}
+
+static CounterSlot* probe(CounterSlot* slots, size_t capacity, const char* key, size_t key_len, uint64_t hash) {
+    size_t mask = capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while (slots[i].hash != 0) {
+        if (slots[i].hash == hash && slots[i].key_len == key_len && memcmp(slots[i].key, key, key_len) == 0) {
+            return &slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static void place_slot(CounterSlot* slots, size_t capacity, const CounterSlot* slot) {
+    size_t mask = capacity - 1;
+    size_t i = (size_t)slot->hash & mask;
+    while (slots[i].hash != 0) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = *slot;
+}
+
+static void migrate_step(CounterTable* table, size_t steps) {
+    size_t end = table->migrate_pos + steps;
+    if (end > table->old_capacity) {
+        end = table->old_capacity;
+    }
+
+    for (size_t i = table->migrate_pos; i < end; i++) {
+        if (table->old_slots[i].hash != 0) {
+            place_slot(table->slots, table->capacity, &table->old_slots[i]);
+        }
+    }
+    table->migrate_pos = end;
+
+    if (table->migrate_pos == table->old_capacity) {
+        free(table->old_slots);
+        table->old_slots = NULL;
+        table->old_capacity = 0;
+        table->migrate_pos = 0;
+    }
+}
+
+static void start_growth(CounterTable* table) {
+    if (table->old_slots != NULL) {
+        migrate_step(table, table->old_capacity);
+    }
+
+    table->old_slots = table->slots;
+    table->old_capacity = table->capacity;
+    table->migrate_pos = 0;
+    table->capacity *= 2;
+    table->slots = (CounterSlot*)calloc(table->capacity, sizeof(CounterSlot));
+}
+
+void init_counter_table(CounterTable* table) {
+    table->capacity = COUNTER_TABLE_INITIAL_CAPACITY;
+    table->size = 0;
+    table->slots = (CounterSlot*)calloc(table->capacity, sizeof(CounterSlot));
+    table->old_slots = NULL;
+    table->old_capacity = 0;
+    table->migrate_pos = 0;
+    table->arena = NULL;
+}
+
+void free_counter_table(CounterTable* table) {
+    free(table->slots);
+    free(table->old_slots);
+    while (table->arena != NULL) {
+        KeyArenaBlock* next = table->arena->next;
+        free(table->arena);
+        table->arena = next;
+    }
+    table->slots = NULL;
+    table->old_slots = NULL;
+    table->capacity = 0;
+    table->size = 0;
+}
+
+void counter_table_add(CounterTable* table, const char* key, size_t key_len, uint64_t hash, int64_t count, int64_t bytes) {
+    if (table->old_slots != NULL) {
+        migrate_step(table, COUNTER_TABLE_MIGRATE_STEP);
+    }
+
+    CounterSlot* slot = probe(table->slots, table->capacity, key, key_len, hash);
+    if (slot->hash != 0) {
+        slot->count += count;
+        slot->bytes += bytes;
+        return;
+    }
+
+    // Slots below migrate_pos were already copied, so a hit here is a key
+    // that has not moved yet and its count is carried over when it does.
+    if (table->old_slots != NULL) {
+        CounterSlot* old_slot = probe(table->old_slots, table->old_capacity, key, key_len, hash);
+        if (old_slot->hash != 0) {
+            old_slot->count += count;
+            old_slot->bytes += bytes;
+            return;
+        }
+    }
+
+    slot->hash = hash;
+    slot->key = arena_copy(table, key, key_len);
+    slot->key_len = key_len;
+    slot->count = count;
+    slot->bytes = bytes;
+    table->size++;
+
+    if (table->size * 10 > table->capacity * 7) {
+        start_growth(table);
+    }
+}
+
+// Completes any pending migration so that slots[] holds every key.
+void counter_table_flush(CounterTable* table) {
+    if (table->old_slots != NULL) {
+        migrate_step(table, table->old_capacity);
+    }
+}
+
+// Grows the table in one step so that it can hold min_size keys without
+// migrating; used before bulk merges, where incremental growth buys nothing.
+static void counter_table_reserve(CounterTable* table, size_t min_size) {
+    counter_table_flush(table);
+
+    size_t capacity = table->capacity;
+    while (min_size * 10 > capacity * 7) {
+        capacity *= 2;
+    }
+    if (capacity == table->capacity) {
+        return;
+    }
+
+    CounterSlot* slots = (CounterSlot*)calloc(capacity, sizeof(CounterSlot));
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].hash != 0) {
+            place_slot(slots, capacity, &table->slots[i]);
+        }
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+}
+
+// Adds every key of src into dst, reusing the hashes stored in src.
+void counter_table_merge(CounterTable* dst, CounterTable* src) {
+    counter_table_flush(src);
+    counter_table_reserve(dst, dst->size + src->size);
+
+    for (size_t i = 0; i < src->capacity; i++) {
+        CounterSlot* slot = &src->slots[i];
+        if (slot->hash != 0) {
+            counter_table_add(dst, slot->key, slot->key_len, slot->hash, slot->count, slot->bytes);
+        }
+    }
+}
+
+static bool key_ranks_before(const CounterSlot* a, const CounterSlot* b) {
+    size_t len = a->key_len < b->key_len ? a->key_len : b->key_len;
+    int cmp = memcmp(a->key, b->key, len);
+    if (cmp != 0) {
+        return cmp < 0;
+    }
+    return a->key_len < b->key_len;
+}
+
+// Higher counts rank first; equal counts are ordered by key so that the
+// report does not depend on slot layout or on the number of threads.
+static bool counter_slot_ranks_before(const void* slot_a, const void* slot_b) {
+    const CounterSlot* a = (const CounterSlot*)slot_a;
+    const CounterSlot* b = (const CounterSlot*)slot_b;
+    if (a->count != b->count) {
+        return a->count > b->count;
+    }
+    return key_ranks_before(a, b);
+}
+
+static bool counter_slot_ranks_before_by_bytes(const void* slot_a, const void* slot_b) {
+    const CounterSlot* a = (const CounterSlot*)slot_a;
+    const CounterSlot* b = (const CounterSlot*)slot_b;
+    if (a->bytes != b->bytes) {
+        return a->bytes > b->bytes;
+    }
+    return key_ranks_before(a, b);
+}
+
+static bool counter_slot_used(const void* slot) {
+    return ((const CounterSlot*)slot)->hash != 0;
+}
+
+// Stores the n highest-ranked slots in out, best first, and returns how many
+// were stored. Slots are ranked by request count, or by bytes sent.
+int counter_table_top_n(CounterTable* table, int n, bool by_bytes, int num_threads, CounterSlot** out) {
+    counter_table_flush(table);
+    return select_top_n(table->slots, sizeof(CounterSlot), table->capacity, counter_slot_used,
+                        by_bytes ? counter_slot_ranks_before_by_bytes : counter_slot_ranks_before,
+                        n, num_threads, (const void**)out);
+}
@@ -0,0 +1,41 @@
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A hash of 0 marks an empty slot. The request count and the bytes sent
+// live in the same slot, so one probe updates both.
+typedef struct {
+    uint64_t hash;
+    char* key;
+    size_t key_len;
+    int64_t count;
+    int64_t bytes;
+} CounterSlot;
+
+typedef struct KeyArenaBlock KeyArenaBlock;
+
+// Open-addressing table with linear probing. Growing allocates the larger
+// slot array up front and moves the old slots over a few at a time on later
+// updates, so no single insert pays for a full rehash.
+typedef struct {
+    CounterSlot* slots;
+    size_t capacity;
+    size_t size;
+    CounterSlot* old_slots;
+    size_t old_capacity;
+    size_t migrate_pos;
+    KeyArenaBlock* arena;
+} CounterTable;
+
+uint64_t hash_bytes(const void* data, size_t len);
+void init_counter_table(CounterTable* table);
+void free_counter_table(CounterTable* table);
+void counter_table_add(CounterTable* table, const char* key, size_t key_len, uint64_t hash, int64_t count, int64_t bytes);
+void counter_table_flush(CounterTable* table);
+void counter_table_merge(CounterTable* dst, CounterTable* src);
+int counter_table_top_n(CounterTable* table, int n, bool by_bytes, int num_threads, CounterSlot** out);
+
+#endif
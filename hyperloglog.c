@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "hyperloglog.h"
+#include "scanner.h"
+
+#define HLL_MAX_VALUE (64 - HLL_PRECISION + 1)
+// Sparse entries use a finer index, as in HyperLogLog++, so that small
+// cardinalities are counted almost exactly.
+#define HLL_SPARSE_PRECISION 25
+#define HLL_SPARSE_MAX_VALUE (64 - HLL_SPARSE_PRECISION + 1)
+#define HLL_SPARSE_INITIAL_CAPACITY 16
+// At this many entries the sparse set (kept at most half full) would need
+// as much memory as the dense registers.
+#define HLL_SPARSE_MAX_SIZE (HLL_REGISTERS / 8)
+
+void init_hyperloglog(HyperLogLog* hll) {
+    hll->registers = NULL;
+    hll->sparse = NULL;
+    hll->sparse_capacity = 0;
+    hll->sparse_size = 0;
+}
+
+void free_hyperloglog(HyperLogLog* hll) {
+    free(hll->registers);
+    free(hll->sparse);
+    init_hyperloglog(hll);
+}
+
+static size_t sparse_home(uint32_t index, size_t capacity) {
+    return (size_t)(index * 0x9E3779B1u) & (capacity - 1);
+}
+
+// Returns true when a new entry had to be added.
+static bool sparse_set(uint32_t* sparse, size_t capacity, uint32_t entry) {
+    uint32_t index = entry >> 6;
+    size_t i = sparse_home(index, capacity);
+    while (sparse[i] != 0) {
+        if (sparse[i] >> 6 == index) {
+            if ((sparse[i] & 0x3F) < (entry & 0x3F)) {
+                sparse[i] = entry;
+            }
+            return false;
+        }
+        i = (i + 1) & (capacity - 1);
+    }
+    sparse[i] = entry;
+    return true;
+}
+
+// Recovers the dense register and value a sparse entry stands for: the low
+// bits of the fine index are the dense index, and the rest of the fine index
+// holds the first bits the dense value counts zeros in.
+static void sparse_entry_to_dense(uint32_t entry, uint32_t* index, uint8_t* value) {
+    uint32_t fine_index = entry >> 6;
+    uint32_t extra_bits = fine_index >> HLL_PRECISION;
+    *index = fine_index & (HLL_REGISTERS - 1);
+    if (extra_bits != 0) {
+        *value = (uint8_t)(scan_ctz64(extra_bits) + 1);
+    } else {
+        *value = (uint8_t)(HLL_SPARSE_PRECISION - HLL_PRECISION + (entry & 0x3F));
+    }
+}
+
+static void convert_to_dense(HyperLogLog* hll) {
+    hll->registers = (uint8_t*)calloc(HLL_REGISTERS, 1);
+    for (size_t i = 0; i < hll->sparse_capacity; i++) {
+        if (hll->sparse[i] != 0) {
+            uint32_t index;
+            uint8_t value;
+            sparse_entry_to_dense(hll->sparse[i], &index, &value);
+            if (hll->registers[index] < value) {
+                hll->registers[index] = value;
+            }
+        }
+    }
+    free(hll->sparse);
+    hll->sparse = NULL;
+    hll->sparse_capacity = 0;
+    hll->sparse_size = 0;
+}
+
+static void set_dense(HyperLogLog* hll, uint32_t index, uint8_t value) {
+    if (hll->registers[index] < value) {
+        hll->registers[index] = value;
+    }
+}
+
+static void add_sparse(HyperLogLog* hll, uint32_t entry) {
+    if (hll->sparse == NULL) {
+        hll->sparse_capacity = HLL_SPARSE_INITIAL_CAPACITY;
+        hll->sparse = (uint32_t*)calloc(hll->sparse_capacity, sizeof(uint32_t));
+    }
+
+    if (sparse_set(hll->sparse, hll->sparse_capacity, entry)) {
+        hll->sparse_size++;
+    }
+
+    if (hll->sparse_size * 2 > hll->sparse_capacity) {
+        if (hll->sparse_size > HLL_SPARSE_MAX_SIZE) {
+            convert_to_dense(hll);
+            return;
+        }
+        size_t capacity = hll->sparse_capacity * 2;
+        uint32_t* sparse = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+        for (size_t i = 0; i < hll->sparse_capacity; i++) {
+            if (hll->sparse[i] != 0) {
+                sparse_set(sparse, capacity, hll->sparse[i]);
+            }
+        }
+        free(hll->sparse);
+        hll->sparse = sparse;
+        hll->sparse_capacity = capacity;
+    }
+}
+
+// The low bits of the hash pick the register; the number of trailing zeros
+// in the rest, plus one, is the value it records.
+void hyperloglog_add(HyperLogLog* hll, uint64_t hash) {
+    if (hll->registers != NULL) {
+        uint64_t rest = hash >> HLL_PRECISION;
+        uint8_t value = rest == 0 ? HLL_MAX_VALUE : (uint8_t)(scan_ctz64(rest) + 1);
+        set_dense(hll, (uint32_t)(hash & (HLL_REGISTERS - 1)), value);
+        return;
+    }
+
+    uint32_t fine_index = (uint32_t)(hash & ((1u << HLL_SPARSE_PRECISION) - 1));
+    uint64_t rest = hash >> HLL_SPARSE_PRECISION;
+    uint32_t value = rest == 0 ? HLL_SPARSE_MAX_VALUE : (uint32_t)(scan_ctz64(rest) + 1);
+    add_sparse(hll, fine_index << 6 | value);
+}
+
+void hyperloglog_merge(HyperLogLog* dst, const HyperLogLog* src) {
+    if (src->registers != NULL) {
+        if (dst->registers == NULL) {
+            convert_to_dense(dst);
+        }
+        for (int i = 0; i < HLL_REGISTERS; i++) {
+            set_dense(dst, (uint32_t)i, src->registers[i]);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < src->sparse_capacity; i++) {
+        if (src->sparse[i] == 0) {
+            continue;
+        }
+        if (dst->registers != NULL) {
+            uint32_t index;
+            uint8_t value;
+            sparse_entry_to_dense(src->sparse[i], &index, &value);
+            set_dense(dst, index, value);
+        } else {
+            add_sparse(dst, src->sparse[i]);
+        }
+    }
+}
+
+static double hll_sigma(double x) {
+    if (x == 1.0) {
+        return INFINITY;
+    }
+    double y = 1.0;
+    double z = x;
+    double previous;
+    do {
+        x *= x;
+        previous = z;
+        z += x * y;
+        y += y;
+    } while (z != previous);
+    return z;
+}
+
+static double hll_tau(double x) {
+    if (x == 0.0 || x == 1.0) {
+        return 0.0;
+    }
+    double y = 1.0;
+    double z = 1.0 - x;
+    double previous;
+    do {
+        x = sqrt(x);
+        previous = z;
+        y *= 0.5;
+        z -= (1.0 - x) * (1.0 - x) * y;
+    } while (z != previous);
+    return z / 3.0;
+}
+
+// Ertl's improved estimator ("New cardinality estimation algorithms for
+// HyperLogLog sketches", 2017): accurate from empty to full sketches without
+// bias tables or a separate linear-counting range.
+double hyperloglog_estimate(const HyperLogLog* hll) {
+    double histogram[HLL_MAX_VALUE + 1] = {0};
+    double m;
+    int max_value;
+
+    if (hll->registers != NULL) {
+        m = HLL_REGISTERS;
+        max_value = HLL_MAX_VALUE;
+        for (int i = 0; i < HLL_REGISTERS; i++) {
+            histogram[hll->registers[i]] += 1.0;
+        }
+    } else {
+        // A sparse sketch is a sketch with 2^25 registers, nearly all zero.
+        m = (double)(1u << HLL_SPARSE_PRECISION);
+        max_value = HLL_SPARSE_MAX_VALUE;
+        histogram[0] = m - (double)hll->sparse_size;
+        for (size_t i = 0; i < hll->sparse_capacity; i++) {
+            if (hll->sparse[i] != 0) {
+                histogram[hll->sparse[i] & 0x3F] += 1.0;
+            }
+        }
+    }
+
+    double z = m * hll_tau(1.0 - histogram[max_value] / m);
+    for (int k = max_value - 1; k >= 1; k--) {
+        z = 0.5 * (z + histogram[k]);
+    }
+    z += m * hll_sigma(histogram[0] / m);
+
+    return m * m / (2.0 * log(2.0)) / z;
+}
@@ -0,0 +1,29 @@
+#ifndef HYPERLOGLOG_H
+#define HYPERLOGLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HLL_PRECISION 13
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+
+// Distinct-count sketch over 64-bit key hashes. Small sketches keep only
+// the registers that are set, as (index << 6 | value) entries with a 25-bit
+// index in a small hash set; once that would take more room than the
+// register array they switch to one byte per register (8 KB, about 1.2%
+// standard error).
+typedef struct {
+    uint8_t* registers;
+    uint32_t* sparse;
+    size_t sparse_capacity;
+    size_t sparse_size;
+} HyperLogLog;
+
+void init_hyperloglog(HyperLogLog* hll);
+void free_hyperloglog(HyperLogLog* hll);
+void hyperloglog_add(HyperLogLog* hll, uint64_t hash);
+void hyperloglog_merge(HyperLogLog* dst, const HyperLogLog* src);
+double hyperloglog_estimate(const HyperLogLog* hll);
+
+#endif
@@ -0,0 +1,191 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "ip_set.h"
+
+#define IP_SET_INITIAL_CAPACITY 64
+
+void init_ip_set(IpSet* set) {
+    set->ranges = NULL;
+    set->count = 0;
+    set->capacity = 0;
+}
+
+void free_ip_set(IpSet* set) {
+    free(set->ranges);
+    init_ip_set(set);
+}
+
+static int compare_ip_keys(const IpKey* a, const IpKey* b) {
+    if (a->hi != b->hi) {
+        return a->hi < b->hi ? -1 : 1;
+    }
+    if (a->lo != b->lo) {
+        return a->lo < b->lo ? -1 : 1;
+    }
+    return 0;
+}
+
+// Last address of the block that starts at prefix.
+static void block_end(const IpKey* prefix, int prefix_len, IpKey* end) {
+    end->hi = prefix->hi;
+    end->lo = prefix->lo;
+    if (prefix_len < 64) {
+        end->hi |= prefix_len == 0 ? ~0ULL : ~0ULL >> prefix_len;
+        end->lo = ~0ULL;
+    } else if (prefix_len < 128) {
+        end->lo |= ~0ULL >> (prefix_len - 64);
+    }
+}
+
+// Parses an address or a CIDR block such as "10.0.0.0/8" or "2001:db8::/32"
+// into the range it covers. IPv4 prefixes count within the IPv4-mapped
+// range. Bits past the prefix are ignored, so "10.1.2.3/8" is 10.0.0.0/8.
+bool parse_ip_range(const char* text, size_t len, IpRange* range) {
+    const char* slash = (const char*)memchr(text, '/', len);
+    size_t address_len = slash != NULL ? (size_t)(slash - text) : len;
+
+    IpKey key;
+    if (!parse_ip_key(text, address_len, &key)) {
+        return false;
+    }
+
+    int max_len = ip_key_is_v4(&key) ? 32 : 128;
+    int prefix_len = max_len;
+    if (slash != NULL) {
+        const char* p = slash + 1;
+        const char* end = text + len;
+        if (p == end || end - p > 3) {
+            return false;
+        }
+        prefix_len = 0;
+        for (; p < end; p++) {
+            if (*p < '0' || *p > '9') {
+                return false;
+            }
+            prefix_len = prefix_len * 10 + (*p - '0');
+        }
+        if (prefix_len > max_len) {
+            return false;
+        }
+    }
+    if (max_len == 32) {
+        prefix_len += 96;
+    }
+
+    ip_key_mask(&key, prefix_len, &range->low);
+    block_end(&range->low, prefix_len, &range->high);
+    return true;
+}
+
+bool ip_range_contains(const IpRange* range, const IpKey* key) {
+    return compare_ip_keys(&range->low, key) <= 0 && compare_ip_keys(key, &range->high) <= 0;
+}
+
+bool ip_set_add(IpSet* set, const char* text, size_t len) {
+    IpRange range;
+    if (!parse_ip_range(text, len, &range)) {
+        return false;
+    }
+
+    if (set->count == set->capacity) {
+        set->capacity = set->capacity > 0 ? set->capacity * 2 : IP_SET_INITIAL_CAPACITY;
+        set->ranges = (IpRange*)realloc(set->ranges, set->capacity * sizeof(IpRange));
+    }
+    set->ranges[set->count++] = range;
+    return true;
+}
+
+static int compare_ranges(const void* a, const void* b) {
+    return compare_ip_keys(&((const IpRange*)a)->low, &((const IpRange*)b)->low);
+}
+
+// Sorts the ranges and merges overlapping and adjacent ones. Must be called
+// after the last ip_set_add and before the first lookup.
+void ip_set_finish(IpSet* set) {
+    if (set->count == 0) {
+        return;
+    }
+
+    qsort(set->ranges, set->count, sizeof(IpRange), compare_ranges);
+
+    size_t merged = 0;
+    for (size_t i = 1; i < set->count; i++) {
+        IpRange* last = &set->ranges[merged];
+        const IpRange* next = &set->ranges[i];
+
+        IpKey after = last->high;
+        bool at_end = after.hi == ~0ULL && after.lo == ~0ULL;
+        if (!at_end) {
+            after.lo++;
+            after.hi += after.lo == 0;
+        }
+
+        if (at_end || compare_ip_keys(&next->low, &after) <= 0) {
+            if (compare_ip_keys(&next->high, &last->high) > 0) {
+                last->high = next->high;
+            }
+        } else {
+            set->ranges[++merged] = *next;
+        }
+    }
+    set->count = merged + 1;
+}
+
+// One address or CIDR block per line; blank lines and lines starting with
+// '#' are skipped. The set is finished on success.
+bool load_ip_set(IpSet* set, const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    char line[256];
+    int line_number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        size_t len = strlen(line);
+        while (len > 0 && isspace((unsigned char)line[len - 1])) {
+            line[--len] = '\0';
+        }
+        size_t start = 0;
+        while (start < len && isspace((unsigned char)line[start])) {
+            start++;
+        }
+        if (start == len || line[start] == '#') {
+            continue;
+        }
+        if (!ip_set_add(set, line + start, len - start)) {
+            fprintf(stderr, "Error: Invalid address or CIDR block on line %d of '%s'\n", line_number, filename);
+            ok = false;
+            break;
+        }
+    }
+
+    fclose(file);
+    if (ok) {
+        ip_set_finish(set);
+    }
+    return ok;
+}
+
+bool ip_set_contains(const IpSet* set, const IpKey* key) {
+    size_t low = 0;
+    size_t high = set->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (compare_ip_keys(&set->ranges[mid].high, key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < set->count && compare_ip_keys(&set->ranges[low].low, key) <= 0;
+}
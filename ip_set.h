@@ -0,0 +1,34 @@
+#ifndef IP_SET_H
+#define IP_SET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ip_table.h"
+
+// Inclusive range of addresses in IpKey order.
+typedef struct {
+    IpKey low;
+    IpKey high;
+} IpRange;
+
+// Addresses and CIDR blocks as sorted, disjoint ranges, so that a lookup
+// is one binary search however many entries the list had. Read-only once
+// finished, so all workers share one.
+typedef struct {
+    IpRange* ranges;
+    size_t count;
+    size_t capacity;
+} IpSet;
+
+bool parse_ip_range(const char* text, size_t len, IpRange* range);
+bool ip_range_contains(const IpRange* range, const IpKey* key);
+
+void init_ip_set(IpSet* set);
+void free_ip_set(IpSet* set);
+bool ip_set_add(IpSet* set, const char* text, size_t len);
+void ip_set_finish(IpSet* set);
+bool load_ip_set(IpSet* set, const char* filename);
+bool ip_set_contains(const IpSet* set, const IpKey* key);
+
+#endif
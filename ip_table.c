@@ -0,0 +1,516 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ip_table.h"
+#include "top_n.h"
+
+#define IP_TABLE_INITIAL_CAPACITY 1024
+#define IP_TABLE_MIGRATE_STEP 16
+#define ROLLUP_MIN_SHARD_SLOTS (64 * 1024)
+
+#define IPV4_MAPPED_PREFIX 0x0000FFFF00000000ULL
+
+static bool parse_ipv4(const char* p, const char* end, uint32_t* address) {
+    uint32_t value = 0;
+    for (int part = 0; part < 4; part++) {
+        if (part > 0) {
+            if (p == end || *p != '.') {
+                return false;
+            }
+            p++;
+        }
+
+        int digits = 0;
+        unsigned int octet = 0;
+        while (p < end && *p >= '0' && *p <= '9' && digits < 3) {
+            octet = octet * 10 + (unsigned int)(*p - '0');
+            p++;
+            digits++;
+        }
+        if (digits == 0 || octet > 255) {
+            return false;
+        }
+        value = value << 8 | octet;
+    }
+
+    if (p != end) {
+        return false;
+    }
+    *address = value;
+    return true;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Accepts the RFC 4291 text forms: full, "::"-compressed and with a dotted
+// IPv4 tail.
+static bool parse_ipv6(const char* p, const char* end, uint16_t groups[8]) {
+    uint16_t head[8], tail[8];
+    int num_head = 0, num_tail = 0;
+    bool compressed = false;
+
+    if (end - p >= 2 && p[0] == ':' && p[1] == ':') {
+        compressed = true;
+        p += 2;
+    } else if (p < end && *p == ':') {
+        return false;
+    }
+
+    while (p < end) {
+        if (num_head + num_tail >= 8) {
+            return false;
+        }
+        uint16_t* list = compressed ? tail : head;
+        int* count = compressed ? &num_tail : &num_head;
+
+        const char* q = p;
+        while (q < end && *q != ':' && *q != '.') {
+            q++;
+        }
+
+        if (q < end && *q == '.') {
+            uint32_t v4;
+            if (num_head + num_tail > 6 || !parse_ipv4(p, end, &v4)) {
+                return false;
+            }
+            list[(*count)++] = (uint16_t)(v4 >> 16);
+            list[(*count)++] = (uint16_t)v4;
+            p = end;
+            break;
+        }
+
+        if (q == p || q - p > 4) {
+            return false;
+        }
+        unsigned int group = 0;
+        for (; p < q; p++) {
+            int digit = hex_value(*p);
+            if (digit < 0) {
+                return false;
+            }
+            group = group << 4 | (unsigned int)digit;
+        }
+        list[(*count)++] = (uint16_t)group;
+
+        if (p == end) {
+            break;
+        }
+        p++;
+        if (p < end && *p == ':') {
+            if (compressed) {
+                return false;
+            }
+            compressed = true;
+            p++;
+        } else if (p == end) {
+            return false;
+        }
+    }
+
+    int total = num_head + num_tail;
+    if (compressed ? total > 7 : total != 8) {
+        return false;
+    }
+
+    memset(groups, 0, 8 * sizeof(uint16_t));
+    memcpy(groups, head, num_head * sizeof(uint16_t));
+    memcpy(groups + 8 - num_tail, tail, num_tail * sizeof(uint16_t));
+    return true;
+}
+
+// Parses a textual IPv4 or IPv6 address; anything else is rejected.
+bool parse_ip_key(const char* text, size_t len, IpKey* key) {
+    const char* end = text + len;
+
+    if (memchr(text, ':', len) == NULL) {
+        uint32_t v4;
+        if (!parse_ipv4(text, end, &v4)) {
+            return false;
+        }
+        key->hi = 0;
+        key->lo = IPV4_MAPPED_PREFIX | v4;
+        return true;
+    }
+
+    uint16_t groups[8];
+    if (!parse_ipv6(text, end, groups)) {
+        return false;
+    }
+    key->hi = 0;
+    key->lo = 0;
+    for (int i = 0; i < 4; i++) {
+        key->hi = key->hi << 16 | groups[i];
+        key->lo = key->lo << 16 | groups[i + 4];
+    }
+    return true;
+}
+
+bool ip_key_is_v4(const IpKey* key) {
+    return key->hi == 0 && (key->lo >> 32) == (IPV4_MAPPED_PREFIX >> 32);
+}
+
+// Clears every bit after the first prefix_len bits of the 128-bit key.
+void ip_key_mask(const IpKey* key, int prefix_len, IpKey* prefix) {
+    if (prefix_len <= 0) {
+        prefix->hi = 0;
+        prefix->lo = 0;
+    } else if (prefix_len < 64) {
+        prefix->hi = key->hi & ~(~0ULL >> prefix_len);
+        prefix->lo = 0;
+    } else if (prefix_len < 128) {
+        prefix->hi = key->hi;
+        prefix->lo = key->lo & ~(~0ULL >> (prefix_len - 64));
+    } else {
+        *prefix = *key;
+    }
+}
+
+// Writes IPv4 in dotted form and IPv6 in the RFC 5952 canonical form.
+void format_ip_key(const IpKey* key, char* buffer, size_t buffer_size) {
+    if (ip_key_is_v4(key)) {
+        uint32_t v4 = (uint32_t)key->lo;
+        snprintf(buffer, buffer_size, "%u.%u.%u.%u",
+                 (unsigned int)(v4 >> 24), (unsigned int)(v4 >> 16 & 0xFF),
+                 (unsigned int)(v4 >> 8 & 0xFF), (unsigned int)(v4 & 0xFF));
+        return;
+    }
+
+    unsigned int groups[8];
+    for (int i = 0; i < 4; i++) {
+        groups[i] = (unsigned int)(key->hi >> (48 - 16 * i) & 0xFFFF);
+        groups[i + 4] = (unsigned int)(key->lo >> (48 - 16 * i) & 0xFFFF);
+    }
+
+    // The longest run of two or more zero groups is written as "::".
+    int best_start = -1, best_len = 0;
+    for (int i = 0; i < 8;) {
+        if (groups[i] != 0) {
+            i++;
+            continue;
+        }
+        int run = i;
+        while (i < 8 && groups[i] == 0) {
+            i++;
+        }
+        if (i - run > best_len && i - run >= 2) {
+            best_start = run;
+            best_len = i - run;
+        }
+    }
+
+    size_t pos = 0;
+    buffer[0] = '\0';
+    for (int i = 0; i < 8 && pos < buffer_size; i++) {
+        if (i == best_start) {
+            pos += snprintf(buffer + pos, buffer_size - pos, "::");
+            i += best_len - 1;
+            continue;
+        }
+        bool after_gap = best_start >= 0 && i == best_start + best_len;
+        pos += snprintf(buffer + pos, buffer_size - pos, i > 0 && !after_gap ? ":%x" : "%x", groups[i]);
+    }
+}
+
+uint64_t ip_key_hash(const IpKey* key) {
+    uint64_t h = key->hi * 0x9E3779B97F4A7C15ULL ^ key->lo;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static IpCounterSlot* probe(IpCounterSlot* slots, size_t capacity, const IpKey* key, uint64_t hash) {
+    size_t mask = capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while (slots[i].count != 0) {
+        if (ip_key_equals(&slots[i].key, key)) {
+            return &slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static void place_slot(IpCounterSlot* slots, size_t capacity, const IpCounterSlot* slot) {
+    size_t mask = capacity - 1;
+    size_t i = (size_t)ip_key_hash(&slot->key) & mask;
+    while (slots[i].count != 0) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = *slot;
+}
+
+static void migrate_step(IpCounterTable* table, size_t steps) {
+    size_t end = table->migrate_pos + steps;
+    if (end > table->old_capacity) {
+        end = table->old_capacity;
+    }
+
+    for (size_t i = table->migrate_pos; i < end; i++) {
+        if (table->old_slots[i].count != 0) {
+            place_slot(table->slots, table->capacity, &table->old_slots[i]);
+        }
+    }
+    table->migrate_pos = end;
+
+    if (table->migrate_pos == table->old_capacity) {
+        free(table->old_slots);
+        table->old_slots = NULL;
+        table->old_capacity = 0;
+        table->migrate_pos = 0;
+    }
+}
+
+static void start_growth(IpCounterTable* table) {
+    if (table->old_slots != NULL) {
+        migrate_step(table, table->old_capacity);
+    }
+
+    table->old_slots = table->slots;
+    table->old_capacity = table->capacity;
+    table->migrate_pos = 0;
+    table->capacity *= 2;
+    table->slots = (IpCounterSlot*)calloc(table->capacity, sizeof(IpCounterSlot));
+}
+
+void init_ip_table(IpCounterTable* table) {
+    table->capacity = IP_TABLE_INITIAL_CAPACITY;
+    table->size = 0;
+    table->slots = (IpCounterSlot*)calloc(table->capacity, sizeof(IpCounterSlot));
+    table->old_slots = NULL;
+    table->old_capacity = 0;
+    table->migrate_pos = 0;
+}
+
+void free_ip_table(IpCounterTable* table) {
+    free(table->slots);
+    free(table->old_slots);
+    table->slots = NULL;
+    table->old_slots = NULL;
+    table->capacity = 0;
+    table->size = 0;
+}
+
+void ip_table_add(IpCounterTable* table, const IpKey* key, uint64_t hash, int64_t count, int64_t bytes) {
+    if (table->old_slots != NULL) {
+        migrate_step(table, IP_TABLE_MIGRATE_STEP);
+    }
+
+    IpCounterSlot* slot = probe(table->slots, table->capacity, key, hash);
+    if (slot->count != 0) {
+        slot->count += count;
+        slot->bytes += bytes;
+        return;
+    }
+
+    if (table->old_slots != NULL) {
+        IpCounterSlot* old_slot = probe(table->old_slots, table->old_capacity, key, hash);
+        if (old_slot->count != 0) {
+            old_slot->count += count;
+            old_slot->bytes += bytes;
+            return;
+        }
+    }
+
+    slot->key = *key;
+    slot->count = count;
+    slot->bytes = bytes;
+    table->size++;
+
+    if (table->size * 10 > table->capacity * 7) {
+        start_growth(table);
+    }
+}
+
+void ip_table_flush(IpCounterTable* table) {
+    if (table->old_slots != NULL) {
+        migrate_step(table, table->old_capacity);
+    }
+}
+
+static void ip_table_reserve(IpCounterTable* table, size_t min_size) {
+    ip_table_flush(table);
+
+    size_t capacity = table->capacity;
+    while (min_size * 10 > capacity * 7) {
+        capacity *= 2;
+    }
+    if (capacity == table->capacity) {
+        return;
+    }
+
+    IpCounterSlot* slots = (IpCounterSlot*)calloc(capacity, sizeof(IpCounterSlot));
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].count != 0) {
+            place_slot(slots, capacity, &table->slots[i]);
+        }
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+}
+
+void ip_table_merge(IpCounterTable* dst, IpCounterTable* src) {
+    ip_table_flush(src);
+    ip_table_reserve(dst, dst->size + src->size);
+
+    for (size_t i = 0; i < src->capacity; i++) {
+        if (src->slots[i].count != 0) {
+            ip_table_add(dst, &src->slots[i].key, ip_key_hash(&src->slots[i].key), src->slots[i].count,
+                         src->slots[i].bytes);
+        }
+    }
+}
+
+static bool ip_slot_used(const void* slot) {
+    return ((const IpCounterSlot*)slot)->count != 0;
+}
+
+static bool ip_key_ranks_before(const IpCounterSlot* a, const IpCounterSlot* b) {
+    if (a->key.hi != b->key.hi) {
+        return a->key.hi < b->key.hi;
+    }
+    return a->key.lo < b->key.lo;
+}
+
+// Higher counts first, then ascending addresses.
+static bool ip_slot_ranks_before(const void* slot_a, const void* slot_b) {
+    const IpCounterSlot* a = (const IpCounterSlot*)slot_a;
+    const IpCounterSlot* b = (const IpCounterSlot*)slot_b;
+    if (a->count != b->count) {
+        return a->count > b->count;
+    }
+    return ip_key_ranks_before(a, b);
+}
+
+static bool ip_slot_ranks_before_by_bytes(const void* slot_a, const void* slot_b) {
+    const IpCounterSlot* a = (const IpCounterSlot*)slot_a;
+    const IpCounterSlot* b = (const IpCounterSlot*)slot_b;
+    if (a->bytes != b->bytes) {
+        return a->bytes > b->bytes;
+    }
+    return ip_key_ranks_before(a, b);
+}
+
+int ip_table_top_n(IpCounterTable* table, int n, bool by_bytes, int num_threads, IpCounterSlot** out) {
+    ip_table_flush(table);
+    return select_top_n(table->slots, sizeof(IpCounterSlot), table->capacity, ip_slot_used,
+                        by_bytes ? ip_slot_ranks_before_by_bytes : ip_slot_ranks_before,
+                        n, num_threads, (const void**)out);
+}
+
+typedef struct {
+    IpCounterSlot* slots;
+    size_t begin;
+    size_t end;
+    NetRollup* rollups;
+    int num_rollups;
+    IpCounterTable* tables;
+} RollupShard;
+
+static void* rollup_shard(void* arg) {
+    RollupShard* shard = (RollupShard*)arg;
+    for (size_t i = shard->begin; i < shard->end; i++) {
+        IpCounterSlot* slot = &shard->slots[i];
+        if (slot->count == 0) {
+            continue;
+        }
+        bool v4 = ip_key_is_v4(&slot->key);
+        for (int r = 0; r < shard->num_rollups; r++) {
+            NetRollup* rollup = &shard->rollups[r];
+            if (rollup->v4 != v4) {
+                continue;
+            }
+            IpKey prefix;
+            ip_key_mask(&slot->key, v4 ? 96 + rollup->prefix_len : rollup->prefix_len, &prefix);
+            ip_table_add(&shard->tables[r], &prefix, ip_key_hash(&prefix), slot->count, slot->bytes);
+        }
+    }
+    return NULL;
+}
+
+// Fills every rollup table from the per-address counts in a single scan of
+// the table, however many prefix lengths are requested. The rollup tables
+// must be initialized. Large tables are scanned by up to num_threads threads
+// whose partial tables are merged at the end.
+void ip_table_rollup(IpCounterTable* table, NetRollup* rollups, int num_rollups, int num_threads) {
+    ip_table_flush(table);
+    if (num_rollups == 0) {
+        return;
+    }
+
+    int num_shards = num_threads;
+    if ((size_t)num_shards > table->capacity / ROLLUP_MIN_SHARD_SLOTS) {
+        num_shards = (int)(table->capacity / ROLLUP_MIN_SHARD_SLOTS);
+    }
+    if (num_shards < 1) {
+        num_shards = 1;
+    }
+
+    RollupShard* shards = (RollupShard*)malloc(num_shards * sizeof(RollupShard));
+    pthread_t* threads = (pthread_t*)malloc(num_shards * sizeof(pthread_t));
+    IpCounterTable* tables = (IpCounterTable*)malloc((size_t)num_shards * num_rollups * sizeof(IpCounterTable));
+
+    size_t shard_slots = table->capacity / num_shards;
+    for (int i = 0; i < num_shards; i++) {
+        shards[i].slots = table->slots;
+        shards[i].begin = i * shard_slots;
+        shards[i].end = i == num_shards - 1 ? table->capacity : (i + 1) * shard_slots;
+        shards[i].rollups = rollups;
+        shards[i].num_rollups = num_rollups;
+        shards[i].tables = tables + (size_t)i * num_rollups;
+        for (int r = 0; r < num_rollups; r++) {
+            if (i == 0) {
+                shards[i].tables[r] = rollups[r].table;
+            } else {
+                init_ip_table(&shards[i].tables[r]);
+            }
+        }
+    }
+
+    int started = 0;
+    for (int i = 1; i < num_shards; i++) {
+        if (pthread_create(&threads[i], NULL, rollup_shard, &shards[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    // Shards that did not get a thread are scanned here.
+    rollup_shard(&shards[0]);
+    for (int i = started + 1; i < num_shards; i++) {
+        rollup_shard(&shards[i]);
+    }
+    for (int i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int r = 0; r < num_rollups; r++) {
+        rollups[r].table = shards[0].tables[r];
+        for (int i = 1; i < num_shards; i++) {
+            ip_table_merge(&rollups[r].table, &shards[i].tables[r]);
+            free_ip_table(&shards[i].tables[r]);
+        }
+    }
+
+    free(tables);
+    free(threads);
+    free(shards);
+}
@@ -0,0 +1,62 @@
+#ifndef IP_TABLE_H
+#define IP_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// 128-bit address in network order split into two words. IPv4 addresses are
+// stored IPv4-mapped (::ffff:a.b.c.d), so both families share one key type.
+typedef struct {
+    uint64_t hi;
+    uint64_t lo;
+} IpKey;
+
+// Longest text produced by format_ip_key, including the terminator.
+#define IP_KEY_TEXT_SIZE 46
+
+// A count of 0 marks an empty slot; every address is keyed, including "::".
+// 32 bytes, so two slots share a cache line.
+typedef struct {
+    IpKey key;
+    int64_t count;
+    int64_t bytes;
+} IpCounterSlot;
+
+// Same growth scheme as CounterTable: the larger slot array is allocated up
+// front and old slots move over a few at a time on later updates.
+typedef struct {
+    IpCounterSlot* slots;
+    size_t capacity;
+    size_t size;
+    IpCounterSlot* old_slots;
+    size_t old_capacity;
+    size_t migrate_pos;
+} IpCounterTable;
+
+// Per-network counts for one address family and prefix length.
+typedef struct {
+    bool v4;
+    int prefix_len; // 0-32 for IPv4, 0-128 for IPv6
+    IpCounterTable table;
+} NetRollup;
+
+bool parse_ip_key(const char* text, size_t len, IpKey* key);
+void format_ip_key(const IpKey* key, char* buffer, size_t buffer_size);
+bool ip_key_is_v4(const IpKey* key);
+void ip_key_mask(const IpKey* key, int prefix_len, IpKey* prefix);
+uint64_t ip_key_hash(const IpKey* key);
+
+static inline bool ip_key_equals(const IpKey* a, const IpKey* b) {
+    return a->hi == b->hi && a->lo == b->lo;
+}
+
+void init_ip_table(IpCounterTable* table);
+void free_ip_table(IpCounterTable* table);
+void ip_table_add(IpCounterTable* table, const IpKey* key, uint64_t hash, int64_t count, int64_t bytes);
+void ip_table_flush(IpCounterTable* table);
+void ip_table_merge(IpCounterTable* dst, IpCounterTable* src);
+int ip_table_top_n(IpCounterTable* table, int n, bool by_bytes, int num_threads, IpCounterSlot** out);
+void ip_table_rollup(IpCounterTable* table, NetRollup* rollups, int num_rollups, int num_threads);
+
+#endif
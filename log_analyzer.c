@@ -11,17 +11,26 @@
 
 #include "regex.h"
 #include "log_analyzer.h"
+#include "scanner.h"
+#include "hash_table.h"
+#include "cpu_topology.h"
+#include "log_cache.h"
+#include "time_seek.h"
+#include "block_filter.h"
+#include "filter_expr.h"
 
 void init_log_formats(LogFormat** formats, int* num_formats) {
     *num_formats = 2;
     *formats = (LogFormat*)malloc(*num_formats * sizeof(LogFormat));
 
     (*formats)[0].name = _strdup("common"); //       .
-    (*formats)[0].pattern = _strdup("^([\\d.]+) \\S+ \\S+ \\[([^\\]]+)\\] \"([A-Z]+) ([^ \"]+)[^\"]*\" (\\d+) (\\d+|-)$");
+    (*formats)[0].pattern = _strdup("^([\\da-fA-F:.]+) \\S+ \\S+ \\[([^\\]]+)\\] \"([A-Z]+) ([^ \"]+)[^\"]*\" (\\d+) (\\d+|-)$");
+    (*formats)[0].fast_parser = FAST_PARSER_COMMON;
     compile_regex(&(*formats)[0]);
 
     (*formats)[1].name = _strdup("combined");
-    (*formats)[1].pattern = _strdup("^([\\d.]+) \\S+ \\S+ \\[([^\\]]+)\\] \"([A-Z]+) ([^ \"]+)[^\"]*\" (\\d+) (\\d+|-) \"([^\"]*)\" \"([^\"]*)\"$");
+    (*formats)[1].pattern = _strdup("^([\\da-fA-F:.]+) \\S+ \\S+ \\[([^\\]]+)\\] \"([A-Z]+) ([^ \"]+)[^\"]*\" (\\d+) (\\d+|-) \"([^\"]*)\" \"([^\"]*)\"$");
+    (*formats)[1].fast_parser = FAST_PARSER_COMBINED;
     compile_regex(&(*formats)[1]);
 }
 
@@ -30,6 +39,7 @@ void add_log_format(LogFormat** formats, int* num_formats, const char* name, con
         if (strcmp((*formats)[i].name, name) == 0) {
             free((*formats)[i].pattern);
             (*formats)[i].pattern = _strdup(pattern);
+            (*formats)[i].fast_parser = FAST_PARSER_NONE;
             regfree(&(*formats)[i].regex);
             compile_regex(&(*formats)[i]);
             return;
@@ -39,6 +49,7 @@ void add_log_format(LogFormat** formats, int* num_formats, const char* name, con
     *formats = (LogFormat*)realloc(*formats, (*num_formats + 1) * sizeof(LogFormat));
     (*formats)[*num_formats].name = _strdup(name);
     (*formats)[*num_formats].pattern = _strdup(pattern);
+    (*formats)[*num_formats].fast_parser = FAST_PARSER_NONE;
     compile_regex(&(*formats)[*num_formats]);
     (*num_formats)++;
 }
@@ -53,332 +64,1193 @@ void compile_regex(LogFormat* format) {
     }
 }
 
+StrSpan make_span(const char* ptr, size_t len) {
+    StrSpan span;
+    span.ptr = ptr;
+    span.len = len;
+    return span;
+}
+
+bool span_equals(StrSpan span, const char* str) {
+    return strncmp(str, span.ptr, span.len) == 0 && str[span.len] == '\0';
+}
+
+// Parses a run of leading digits; "-" and other non-numeric fields give 0,
+// and values past INT64_MAX saturate instead of wrapping.
+int64_t span_to_int64(StrSpan span) {
+    int64_t value = 0;
+    for (size_t i = 0; i < span.len && span.ptr[i] >= '0' && span.ptr[i] <= '9'; i++) {
+        int digit = span.ptr[i] - '0';
+        if (value > (INT64_MAX - digit) / 10) {
+            return INT64_MAX;
+        }
+        value = value * 10 + digit;
+    }
+    return value;
+}
+
 RegexMatches* create_regex_matches(int nmatch) {
     RegexMatches* matches = (RegexMatches*)malloc(sizeof(RegexMatches));
     matches->nmatch = nmatch;
     matches->matches = (regmatch_t*)malloc(nmatch * sizeof(regmatch_t));
+    matches->line_capacity = 4096;
+    matches->line_buffer = (char*)malloc(matches->line_capacity);
     return matches;
 }
 
 void free_regex_matches(RegexMatches* matches) {
+    free(matches->line_buffer);
     free(matches->matches);
     free(matches);
 }
 
-bool parse_log_entry(char* line, LogFormat* format, LogEntry* entry, RegexMatches* matches) {
-    int ret = regexec(&format->regex, line, matches->nmatch, matches->matches, 0);
-    if (ret != 0) {
+// regexec needs a NUL-terminated string, so lines taking the regex path are
+// copied into the per-thread buffer first.
+static const char* stage_line(RegexMatches* matches, const char* line, size_t len) {
+    if (len + 1 > matches->line_capacity) {
+        while (len + 1 > matches->line_capacity) {
+            matches->line_capacity *= 2;
+        }
+        matches->line_buffer = (char*)realloc(matches->line_buffer, matches->line_capacity);
+    }
+    memcpy(matches->line_buffer, line, len);
+    matches->line_buffer[len] = '\0';
+    return matches->line_buffer;
+}
+
+static StrSpan match_span(const char* line, const regmatch_t* m) {
+    return make_span(line + m->rm_so, (size_t)(m->rm_eo - m->rm_so));
+}
+
+static void set_match(regmatch_t* m, const char* line, const char* start, const char* end) {
+    m->rm_so = (regoff_t)(start - line);
+    m->rm_eo = (regoff_t)(end - line);
+}
+
+static const char* find_quote(const char* p, const char* end) {
+    while (p < end) {
+        size_t len = (size_t)(end - p) < SCAN_BLOCK_SIZE ? (size_t)(end - p) : SCAN_BLOCK_SIZE;
+        ScanBitmap bitmap;
+        scan_bitmap_block(p, len, &bitmap);
+        if (bitmap.quote != 0) {
+            return p + scan_ctz64(bitmap.quote);
+        }
+        p += len;
+    }
+    return end;
+}
+
+static const char* skip_digits(const char* p, const char* end) {
+    while (p < end && *p >= '0' && *p <= '9') {
+        p++;
+    }
+    return p;
+}
+
+// Single-pass parser for the built-in common and combined layouts. It fills
+// the same capture slots as the patterns in init_log_formats and rejects
+// every line those patterns would reject, so the regex only sees the rest.
+static bool parse_clf_fields(const char* line, size_t len, bool combined, regmatch_t* m) {
+    const char* p = line;
+    const char* end = line + len;
+    const char* start;
+
+    // Client address, IPv4 or IPv6
+    start = p;
+    while (p < end && (isxdigit((unsigned char)*p) || *p == ':' || *p == '.')) {
+        p++;
+    }
+    if (p == start || p == end || *p != ' ') {
+        return false;
+    }
+    set_match(&m[1], line, start, p);
+    p++;
+
+    // ident and authuser
+    for (int i = 0; i < 2; i++) {
+        start = p;
+        while (p < end && !isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (p == start || p == end || *p != ' ') {
+            return false;
+        }
+        p++;
+    }
+
+    if (p == end || *p != '[') {
+        return false;
+    }
+    start = ++p;
+    while (p < end && *p != ']') {
+        p++;
+    }
+    if (p == start || end - p < 3 || p[1] != ' ' || p[2] != '"') {
+        return false;
+    }
+    set_match(&m[2], line, start, p);
+    p += 3;
+
+    start = p;
+    while (p < end && *p >= 'A' && *p <= 'Z') {
+        p++;
+    }
+    if (p == start || p == end || *p != ' ') {
+        return false;
+    }
+    set_match(&m[3], line, start, p);
+    p++;
+
+    start = p;
+    while (p < end && *p != ' ' && *p != '"') {
+        p++;
+    }
+    if (p == start) {
+        return false;
+    }
+    set_match(&m[4], line, start, p);
+
+    // Protocol part of the request line
+    p = find_quote(p, end);
+    if (end - p < 2 || p[1] != ' ') {
         return false;
     }
+    p += 2;
 
-    int ip_idx = 1;
-    int datetime_idx = 2;
-    int method_idx = 3;
-    int url_idx = 4;
-    int code_idx = 5;
-    int size_idx = 6;
-    int referer_idx = 7;
-    int useragent_idx = 8;
-
-    regmatch_t* m = &matches->matches[ip_idx];
-    int len = m->rm_eo - m->rm_so;
-    entry->ip = (char*)malloc(len + 1);
-    strncpy(entry->ip, line + m->rm_so, len);
-    entry->ip[len] = '\0';
-
-    m = &matches->matches[datetime_idx];
-    len = m->rm_eo - m->rm_so;
-    entry->datetime = (char*)malloc(len + 1);
-    strncpy(entry->datetime, line + m->rm_so, len);
-    entry->datetime[len] = '\0';
-
-    m = &matches->matches[method_idx];
-    len = m->rm_eo - m->rm_so;
-    entry->method = (char*)malloc(len + 1);
-    strncpy(entry->method, line + m->rm_so, len);
-    entry->method[len] = '\0';
-
-    m = &matches->matches[url_idx];
-    len = m->rm_eo - m->rm_so;
-    entry->url = (char*)malloc(len + 1);
-    strncpy(entry->url, line + m->rm_so, len);
-    entry->url[len] = '\0';
-
-    m = &matches->matches[code_idx];
-    len = m->rm_eo - m->rm_so;
-    char* code_str = (char*)malloc(len + 1);
-    strncpy(code_str, line + m->rm_so, len);
-    code_str[len] = '\0';
-    entry->code = atoi(code_str);
-    free(code_str);
-
-    m = &matches->matches[size_idx];
-    len = m->rm_eo - m->rm_so;
-    char* size_str = (char*)malloc(len + 1);
-    strncpy(size_str, line + m->rm_so, len);
-    size_str[len] = '\0';
-    if (strcmp(size_str, "-") == 0) {
-        entry->size = 0;
+    start = p;
+    p = skip_digits(p, end);
+    if (p == start || p == end || *p != ' ') {
+        return false;
+    }
+    set_match(&m[5], line, start, p);
+    p++;
+
+    start = p;
+    if (p < end && *p == '-') {
+        p++;
     } else {
-        entry->size = atol(size_str);
+        p = skip_digits(p, end);
+    }
+    if (p == start) {
+        return false;
+    }
+    set_match(&m[6], line, start, p);
+
+    if (!combined) {
+        return p == end;
+    }
+
+    if (end - p < 2 || p[0] != ' ' || p[1] != '"') {
+        return false;
+    }
+    start = p += 2;
+    p = find_quote(p, end);
+    if (end - p < 3 || p[1] != ' ' || p[2] != '"') {
+        return false;
     }
-    free(size_str);
-                         
+    set_match(&m[7], line, start, p);
+
+    start = p += 3;
+    p = find_quote(p, end);
+    if (end - p != 1) {
+        return false;
+    }
+    set_match(&m[8], line, start, p);
+
+    return true;
+}
+
+bool parse_log_entry(const char* line, size_t line_len, LogFormat* format, LogEntry* entry, RegexMatches* matches) {
+    if (format->fast_parser == FAST_PARSER_NONE
+        || !parse_clf_fields(line, line_len, format->fast_parser == FAST_PARSER_COMBINED, matches->matches)) {
+        line = stage_line(matches, line, line_len);
+        int ret = regexec(&format->regex, line, matches->nmatch, matches->matches, 0);
+        if (ret != 0) {
+            return false;
+        }
+    }
+
+    regmatch_t* m = matches->matches;
+    entry->ip = match_span(line, &m[1]);
+    entry->datetime = match_span(line, &m[2]);
+    entry->method = match_span(line, &m[3]);
+    entry->url = match_span(line, &m[4]);
+    entry->code = (int)span_to_int64(match_span(line, &m[5]));
+    entry->size = span_to_int64(match_span(line, &m[6]));
+
     if (strcmp(format->name, "common") == 0) {
-        entry->referer = _strdup("-");
-        entry->useragent = _strdup("-");
+        entry->referer = make_span("-", 1);
+        entry->useragent = make_span("-", 1);
     } else {
-        m = &matches->matches[referer_idx];
-        len = m->rm_eo - m->rm_so;
-        entry->referer = (char*)malloc(len + 1);
-        strncpy(entry->referer, line + m->rm_so, len);
-        entry->referer[len] = '\0';
-
-        m = &matches->matches[useragent_idx];
-        len = m->rm_eo - m->rm_so;
-        entry->useragent = (char*)malloc(len + 1);
-        strncpy(entry->useragent, line + m->rm_so, len);
-        entry->useragent[len] = '\0';
+        entry->referer = match_span(line, &m[7]);
+        entry->useragent = match_span(line, &m[8]);
     }
 
     return true;
 }
 
-void free_log_entry(LogEntry* entry) {
-    free(entry->ip);
-    free(entry->datetime);
-    free(entry->method);
-    free(entry->url);
-    free(entry->referer);
-    free(entry->useragent);
+static void init_distinct_counts(DistinctCounts* counts) {
+    init_hyperloglog(&counts->ips);
+    init_hyperloglog(&counts->urls);
+    init_hyperloglog(&counts->useragents);
+}
+
+static void free_distinct_counts(DistinctCounts* counts) {
+    free_hyperloglog(&counts->ips);
+    free_hyperloglog(&counts->urls);
+    free_hyperloglog(&counts->useragents);
 }
 
-void init_analyzer_stats(AnalyzerStats* stats) {
-    stats->ip_stats.ips = NULL;
-    stats->ip_stats.counts = NULL;
-    stats->ip_stats.size = 0;
-    stats->ip_stats.capacity = 0;
+static void merge_distinct_counts(DistinctCounts* dst, const DistinctCounts* src) {
+    hyperloglog_merge(&dst->ips, &src->ips);
+    hyperloglog_merge(&dst->urls, &src->urls);
+    hyperloglog_merge(&dst->useragents, &src->useragents);
+}
+
+void init_analyzer_stats(AnalyzerStats* stats, const AnalyzerOptions* options) {
+    stats->options = *options;
 
-    stats->url_stats.urls = NULL;
-    stats->url_stats.counts = NULL;
-    stats->url_stats.size = 0;
-    stats->url_stats.capacity = 0;
+    init_ip_table(&stats->ip_stats);
+    init_counter_table(&stats->host_stats);
+    init_counter_table(&stats->url_stats);
 
     memset(stats->response_codes, 0, sizeof(stats->response_codes));
+    memset(stats->response_bytes, 0, sizeof(stats->response_bytes));
 
-    stats->useragent_stats.useragents = NULL;
-    stats->useragent_stats.counts = NULL;
-    stats->useragent_stats.size = 0;
-    stats->useragent_stats.capacity = 0;
+    init_counter_table(&stats->useragent_stats);
 
     stats->time_stats.start_time = 0;
     stats->time_stats.end_time = 0;
-    stats->time_stats.counts_per_hour = (int*)calloc(24, sizeof(int));
+    stats->time_stats.counts_per_hour = (int64_t*)calloc(24, sizeof(int64_t));
+    init_time_series(&stats->time_stats.series, options->bucket_width);
 
-    pthread_mutex_init(&stats->mutex, NULL);
-}
+    init_counter_table(&stats->group_stats);
+    if (options->num_group_fields > 0 && options->approx_counters > 0) {
+        init_space_saving(&stats->group_approx, options->approx_counters);
+    }
 
-void free_analyzer_stats(AnalyzerStats* stats) {
-    for (int i = 0; i < stats->ip_stats.size; i++) {
-        free(stats->ip_stats.ips[i]);
+    if (options->approx_counters > 0) {
+        init_space_saving(&stats->ip_approx, options->approx_counters);
+        init_space_saving(&stats->url_approx, options->approx_counters);
+        init_space_saving(&stats->useragent_approx, options->approx_counters);
     }
-    free(stats->ip_stats.ips);
-    free(stats->ip_stats.counts);
 
-    for (int i = 0; i < stats->url_stats.size; i++) {
-        free(stats->url_stats.urls[i]);
+    stats->distinct_per_hour = NULL;
+    if (options->distinct_counts) {
+        init_distinct_counts(&stats->distinct_total);
+        stats->distinct_per_hour = (DistinctCounts*)malloc(24 * sizeof(DistinctCounts));
+        for (int i = 0; i < 24; i++) {
+            init_distinct_counts(&stats->distinct_per_hour[i]);
+        }
     }
-    free(stats->url_stats.urls);
-    free(stats->url_stats.counts);
 
-    for (int i = 0; i < stats->useragent_stats.size; i++) {
-        free(stats->useragent_stats.useragents[i]);
+    if (options->size_quantiles) {
+        init_ddsketch(&stats->size_total);
+        for (int i = 0; i < 6; i++) {
+            init_ddsketch(&stats->size_per_class[i]);
+        }
+        if (options->approx_counters == 0) {
+            init_ddsketch_table(&stats->size_per_url);
+        }
     }
-    free(stats->useragent_stats.useragents);
-    free(stats->useragent_stats.counts);
+}
+
+void free_analyzer_stats(AnalyzerStats* stats) {
+    free_ip_table(&stats->ip_stats);
+    free_counter_table(&stats->host_stats);
+    free_counter_table(&stats->url_stats);
+    free_counter_table(&stats->useragent_stats);
 
     free(stats->time_stats.counts_per_hour);
+    free_time_series(&stats->time_stats.series);
 
-    pthread_mutex_destroy(&stats->mutex);
+    free_counter_table(&stats->group_stats);
+    if (stats->options.num_group_fields > 0 && stats->options.approx_counters > 0) {
+        free_space_saving(&stats->group_approx);
+    }
+
+    if (stats->options.approx_counters > 0) {
+        free_space_saving(&stats->ip_approx);
+        free_space_saving(&stats->url_approx);
+        free_space_saving(&stats->useragent_approx);
+    }
+
+    if (stats->options.distinct_counts) {
+        free_distinct_counts(&stats->distinct_total);
+        for (int i = 0; i < 24; i++) {
+            free_distinct_counts(&stats->distinct_per_hour[i]);
+        }
+        free(stats->distinct_per_hour);
+    }
+
+    if (stats->options.size_quantiles) {
+        free_ddsketch(&stats->size_total);
+        for (int i = 0; i < 6; i++) {
+            free_ddsketch(&stats->size_per_class[i]);
+        }
+        if (stats->options.approx_counters == 0) {
+            free_ddsketch_table(&stats->size_per_url);
+        }
+    }
 }
 
-void* process_log_chunk(void* arg) {
-    ThreadData* data = (ThreadData*)arg;
-    FILE* file = data->file;
-    LogFormat* format = data->format;
-    AnalyzerStats* stats = data->stats;
+void merge_analyzer_stats(AnalyzerStats* dst, AnalyzerStats* src) {
+    ip_table_merge(&dst->ip_stats, &src->ip_stats);
+    counter_table_merge(&dst->host_stats, &src->host_stats);
+    counter_table_merge(&dst->url_stats, &src->url_stats);
+    counter_table_merge(&dst->useragent_stats, &src->useragent_stats);
 
-    int nmatch = 9;
-    RegexMatches* matches = create_regex_matches(nmatch);
+    for (int i = 0; i < 600; i++) {
+        dst->response_codes[i] += src->response_codes[i];
+        dst->response_bytes[i] += src->response_bytes[i];
+    }
 
-    fseek(file, data->start_offset, SEEK_SET);
+    for (int i = 0; i < 24; i++) {
+        dst->time_stats.counts_per_hour[i] += src->time_stats.counts_per_hour[i];
+    }
+    time_series_merge(&dst->time_stats.series, &src->time_stats.series);
 
-    if (data->start_offset > 0) {
-        char c;
-        do {
-            c = fgetc(file);
-            if (c == '\n' || c == EOF) {
-                break;
-            }
-        } while (1);
+    counter_table_merge(&dst->group_stats, &src->group_stats);
+    if (dst->options.num_group_fields > 0 && dst->options.approx_counters > 0) {
+        space_saving_merge(&dst->group_approx, &src->group_approx);
     }
 
-    char line[4096];
+    if (dst->options.approx_counters > 0) {
+        space_saving_merge(&dst->ip_approx, &src->ip_approx);
+        space_saving_merge(&dst->url_approx, &src->url_approx);
+        space_saving_merge(&dst->useragent_approx, &src->useragent_approx);
+    }
 
-    while (ftell(file) < data->end_offset && fgets(line, sizeof(line), file) != NULL) {
-        int len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n') {
-            line[len - 1] = '\0';
+    if (dst->options.distinct_counts) {
+        merge_distinct_counts(&dst->distinct_total, &src->distinct_total);
+        for (int i = 0; i < 24; i++) {
+            merge_distinct_counts(&dst->distinct_per_hour[i], &src->distinct_per_hour[i]);
         }
+    }
 
-        LogEntry entry;
-        if (!parse_log_entry(line, format, &entry, matches)) {
-            continue;
+    if (dst->options.size_quantiles) {
+        ddsketch_merge(&dst->size_total, &src->size_total);
+        for (int i = 0; i < 6; i++) {
+            ddsketch_merge(&dst->size_per_class[i], &src->size_per_class[i]);
+        }
+        if (dst->options.approx_counters == 0) {
+            ddsketch_table_merge(&dst->size_per_url, &src->size_per_url);
         }
+    }
+}
 
-        if (data->ip_filter != NULL && strcmp(data->ip_filter, entry.ip) != 0) {
-            free_log_entry(&entry);
-            continue;
+typedef struct {
+    AnalyzerStats* dst;
+    AnalyzerStats* src;
+} MergeTask;
+
+static void* merge_task(void* arg) {
+    MergeTask* task = (MergeTask*)arg;
+    merge_analyzer_stats(task->dst, task->src);
+    free_analyzer_stats(task->src);
+    return NULL;
+}
+
+// Folds stats[1..count) into stats[0] as a binary tree: every round merges
+// disjoint pairs in parallel and halves the number of partial results.
+// The merged-away entries are freed along the way.
+void merge_analyzer_stats_parallel(AnalyzerStats* stats, int count) {
+    pthread_t* threads = (pthread_t*)malloc(count * sizeof(pthread_t));
+    MergeTask* tasks = (MergeTask*)malloc(count * sizeof(MergeTask));
+
+    for (int stride = 1; stride < count; stride *= 2) {
+        int num_tasks = 0;
+        for (int i = 0; i + stride < count; i += 2 * stride) {
+            tasks[num_tasks].dst = &stats[i];
+            tasks[num_tasks].src = &stats[i + stride];
+            num_tasks++;
         }
 
-        if (data->url_filter != NULL && strcmp(data->url_filter, entry.url) != 0) {
-            free_log_entry(&entry);
-            continue;
+        int started = 0;
+        for (int i = 1; i < num_tasks; i++) {
+            if (pthread_create(&threads[i], NULL, merge_task, &tasks[i]) != 0) {
+                break;
+            }
+            started++;
         }
 
-        time_t entry_time = parse_datetime(entry.datetime);
-        if (data->start_time_filter > 0 && entry_time < data->start_time_filter) {
-            free_log_entry(&entry);
-            continue;
+        // Pairs that did not get a thread are merged here.
+        merge_task(&tasks[0]);
+        for (int i = started + 1; i < num_tasks; i++) {
+            merge_task(&tasks[i]);
         }
 
-        if (data->end_time_filter > 0 && entry_time > data->end_time_filter) {
-            free_log_entry(&entry);
-            continue;
+        for (int i = 1; i <= started; i++) {
+            pthread_join(threads[i], NULL);
         }
+    }
 
-        pthread_mutex_lock(&stats->mutex);
-        update_ip_stats(stats, entry.ip);
-        update_url_stats(stats, entry.url);
-        update_response_code_stats(stats, entry.code);
-        update_useragent_stats(stats, entry.useragent);
-        update_time_stats(stats, entry.datetime);
-        pthread_mutex_unlock(&stats->mutex);
+    free(threads);
+    free(tasks);
+}
 
-        free_log_entry(&entry);
+// Returns the offset of the first line that starts at or after offset.
+size_t align_to_line_start(const char* data, size_t data_size, size_t offset) {
+    if (offset == 0 || offset >= data_size) {
+        return offset < data_size ? offset : data_size;
     }
 
-    free_regex_matches(matches);
+    if (data[offset - 1] == '\n') {
+        return offset;
+    }
 
-    return NULL;
+    const char* newline = scan_find_newline(data + offset, data + data_size);
+    return newline < data + data_size ? (size_t)(newline - data) + 1 : data_size;
+}
+
+// Length of the line in [line, line_end) without the '\r' of a CRLF line
+// ending, which the mapped file keeps.
+static size_t line_length(const char* line, const char* line_end) {
+    size_t len = (size_t)(line_end - line);
+    return len > 0 && line[len - 1] == '\r' ? len - 1 : len;
+}
+
+typedef struct {
+    const char* data;
+    size_t data_size;
+    LogFormat* format;
+    RegexMatches* matches;
+} LogTimeProbe;
+
+static bool probe_log_time(void* context, size_t position, size_t limit, size_t* next, int64_t* time) {
+    LogTimeProbe* probe = (LogTimeProbe*)context;
+    const char* data_end = probe->data + probe->data_size;
+    size_t offset = align_to_line_start(probe->data, probe->data_size, position);
+
+    while (offset < limit) {
+        const char* line = probe->data + offset;
+        const char* line_end = scan_find_newline(line, data_end);
+        offset = line_end < data_end ? (size_t)(line_end - probe->data) + 1 : probe->data_size;
+
+        LogEntry entry;
+        LogTime entry_time;
+        if (parse_log_entry(line, line_length(line, line_end), probe->format, &entry, probe->matches)
+            && parse_log_time(entry.datetime, &entry_time)) {
+            *next = offset;
+            *time = (int64_t)entry_time.epoch;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Narrows a -start/-end query to the byte range [*start_offset, *end_offset)
+// of the log that can hold matching lines, so the workers read only that.
+// Both offsets are line starts. Falls back to the whole log if it is not in
+// time order.
+bool find_log_time_range(const char* data, size_t data_size, LogFormat* format, time_t start_time, time_t end_time,
+                         size_t* start_offset, size_t* end_offset) {
+    LogTimeProbe probe;
+    probe.data = data;
+    probe.data_size = data_size;
+    probe.format = format;
+    probe.matches = create_regex_matches(9);
+
+    bool found = seek_time_range(probe_log_time, &probe, data_size, (int64_t)start_time, (int64_t)end_time,
+                                 start_offset, end_offset);
+    free_regex_matches(probe.matches);
+    return found;
+}
+
+// Scratch state owned by one worker thread.
+typedef struct {
+    RegexMatches* matches;
+    TimestampCache time_cache;
+    // An -ip filter that parses as an address matches every spelling of it.
+    bool ip_filter_is_address;
+    IpKey ip_filter_key;
+    // Hashes of the -ip and -url keys as the block filters store them.
+    uint64_t ip_filter_hash;
+    uint64_t url_filter_hash;
+    // Composite -groupby key of the current line.
+    char* group_key;
+    size_t group_key_capacity;
+    // Normalized URL of the current line, when it differs from the raw one.
+    char* url_buffer;
+    size_t url_buffer_capacity;
+} WorkerState;
+
+static uint64_t record_ip_hash(const LogRecord* record) {
+    return record->ip_is_address ? ip_key_hash(&record->ip_key) : hash_bytes(record->entry.ip.ptr, record->entry.ip.len);
 }
 
-void update_ip_stats(AnalyzerStats* stats, const char* ip) {
-    for (int i = 0; i < stats->ip_stats.size; i++) {
-        if (strcmp(stats->ip_stats.ips[i], ip) == 0) {
-            stats->ip_stats.counts[i]++;
+// Applies the filters to one request and, if it passes, adds it to the
+// worker's stats. Hashes already present in record are used as they are.
+static void count_record(ThreadData* data, WorkerState* worker, LogRecord* record) {
+    AnalyzerStats* stats = data->stats;
+    LogEntry* entry = &record->entry;
+
+    if (data->ip_filter != NULL) {
+        bool match = worker->ip_filter_is_address
+            ? record->ip_is_address && ip_key_equals(&record->ip_key, &worker->ip_filter_key)
+            : span_equals(entry->ip, data->ip_filter);
+        if (!match) {
             return;
         }
     }
 
-    if (stats->ip_stats.size >= stats->ip_stats.capacity) {
-        int new_capacity = stats->ip_stats.capacity == 0 ? 100 : stats->ip_stats.capacity * 2;
-        stats->ip_stats.ips = (char**)realloc(stats->ip_stats.ips, new_capacity * sizeof(char*));
-        stats->ip_stats.counts = (int*)realloc(stats->ip_stats.counts, new_capacity * sizeof(int));
-        stats->ip_stats.capacity = new_capacity;
+    if (data->ip_set != NULL && !(record->ip_is_address && ip_set_contains(data->ip_set, &record->ip_key))) {
+        return;
+    }
+    if (data->ip_exclude_set != NULL && record->ip_is_address
+        && ip_set_contains(data->ip_exclude_set, &record->ip_key)) {
+        return;
+    }
+
+    if (data->url_filter != NULL && !span_equals(entry->url, data->url_filter)) {
+        return;
+    }
+
+    bool has_time = record->has_time;
+    if (data->start_time_filter > 0 && (!has_time || record->time.epoch < data->start_time_filter)) {
+        return;
+    }
+
+    if (data->end_time_filter > 0 && (!has_time || record->time.epoch > data->end_time_filter)) {
+        return;
+    }
+
+    if (data->where != NULL && !filter_expr_matches(data->where, record)) {
+        return;
+    }
+
+    // Normalized after the -url filter, which matches URLs as written,
+    // and before anything is hashed or counted.
+    if (data->url_normalizer != NULL) {
+        size_t url_len;
+        const char* url = normalize_url(data->url_normalizer, entry->url.ptr, entry->url.len,
+                                        &worker->url_buffer, &worker->url_buffer_capacity, &url_len);
+        if (url != entry->url.ptr) {
+            record->url_hash = 0;
+        }
+        entry->url = make_span(url, url_len);
+    }
+
+    if (record->ip_hash == 0) {
+        record->ip_hash = record_ip_hash(record);
+    }
+    if (record->url_hash == 0) {
+        record->url_hash = hash_bytes(entry->url.ptr, entry->url.len);
+    }
+    if (record->useragent_hash == 0) {
+        record->useragent_hash = hash_bytes(entry->useragent.ptr, entry->useragent.len);
+    }
+
+    update_ip_stats(stats, entry->ip, record->ip_is_address ? &record->ip_key : NULL, record->ip_hash, entry->size);
+    update_url_stats(stats, entry->url, record->url_hash, entry->size);
+    update_response_code_stats(stats, entry->code, entry->size);
+    update_useragent_stats(stats, entry->useragent, record->useragent_hash, entry->size);
+    if (has_time) {
+        update_time_stats(stats, &record->time, entry->code, entry->size);
+    }
+    if (stats->options.distinct_counts) {
+        update_distinct_stats(stats, record->ip_hash, record->url_hash, record->useragent_hash,
+                              has_time ? log_time_hour(&record->time) : -1);
+    }
+    if (stats->options.size_quantiles) {
+        update_size_stats(stats, entry->code, entry->size, record->url_hash);
+    }
+    if (stats->options.num_group_fields > 0) {
+        size_t key_len = build_group_key(&stats->options, record, &worker->group_key, &worker->group_key_capacity);
+        update_group_stats(stats, make_span(worker->group_key, key_len), entry->size);
+    }
+}
+
+static void process_log_line(ThreadData* data, WorkerState* worker, const char* line, size_t len) {
+    LogRecord record;
+    if (!parse_log_entry(line, len, data->format, &record.entry, worker->matches)) {
+        return;
     }
 
-    stats->ip_stats.ips[stats->ip_stats.size] = _strdup(ip);
-    stats->ip_stats.counts[stats->ip_stats.size] = 1;
-    stats->ip_stats.size++;
+    record.ip_is_address = parse_ip_key(record.entry.ip.ptr, record.entry.ip.len, &record.ip_key);
+    record.has_time = parse_log_time_cached(&worker->time_cache, record.entry.datetime, &record.time);
+    record.ip_hash = 0;
+    record.url_hash = 0;
+    record.useragent_hash = 0;
+
+    // The cache gets every parsed line, whatever this run filters out.
+    if (data->cache_builder != NULL) {
+        log_cache_builder_add(data->cache_builder, &record);
+    }
+
+    // Filters hold the raw URL, as the -url filter compares it.
+    if (data->block_filter_builder != NULL) {
+        size_t line_offset = data->data_offset + (size_t)(line - data->data);
+        if (record.ip_hash == 0) {
+            record.ip_hash = record_ip_hash(&record);
+        }
+        if (record.url_hash == 0) {
+            record.url_hash = hash_bytes(record.entry.url.ptr, record.entry.url.len);
+        }
+        block_filter_add(data->block_filter_builder, line_offset, BLOCK_FILTER_IP, record.ip_hash);
+        block_filter_add(data->block_filter_builder, line_offset, BLOCK_FILTER_URL, record.url_hash);
+    }
+
+    count_record(data, worker, &record);
 }
 
-void update_url_stats(AnalyzerStats* stats, const char* url) {
-    for (int i = 0; i < stats->url_stats.size; i++) {
-        if (strcmp(stats->url_stats.urls[i], url) == 0) {
-            stats->url_stats.counts[i]++;
+// Only the lines that contain the prefilter text are parsed. The search
+// runs over the raw block and stops at the end of the last line that
+// starts in it; a hit is widened to its whole line.
+static void process_prefiltered_block(ThreadData* data, WorkerState* worker, const char* cursor,
+                                      const char* block_end) {
+    const char* data_end = data->data + data->data_size;
+    const char* search_end = block_end < data_end ? scan_find_newline(block_end - 1, data_end) : data_end;
+    size_t literal_len = strlen(data->prefilter);
+
+    while (cursor < search_end) {
+        const char* hit = scan_find_literal(cursor, search_end, data->prefilter, literal_len);
+        if (hit == search_end) {
             return;
         }
+
+        const char* line = hit;
+        while (line > cursor && line[-1] != '\n') {
+            line--;
+        }
+        const char* line_end = scan_find_newline(hit, data_end);
+        process_log_line(data, worker, line, line_length(line, line_end));
+        cursor = line_end < data_end ? line_end + 1 : data_end;
+    }
+}
+
+// Parses and aggregates every line whose first byte lies in [start_offset, end_offset).
+static void process_log_block(ThreadData* data, WorkerState* worker, size_t start_offset, size_t end_offset) {
+    const char* cursor = data->data + align_to_line_start(data->data, data->data_size, start_offset);
+    const char* block_end = data->data + end_offset;
+    const char* data_end = data->data + data->data_size;
+
+    if (data->prefilter != NULL) {
+        process_prefiltered_block(data, worker, cursor, block_end);
+        return;
+    }
+
+    while (cursor < block_end) {
+        const char* line_end = scan_find_newline(cursor, data_end);
+        const char* line = cursor;
+        cursor = line_end < data_end ? line_end + 1 : data_end;
+        process_log_line(data, worker, line, line_length(line, line_end));
+    }
+}
+
+// Aggregates rows [start_row, end_row) of the cache; nothing is parsed.
+static void process_cache_rows(ThreadData* data, WorkerState* worker, size_t start_row, size_t end_row) {
+    for (size_t row = start_row; row < end_row; row++) {
+        LogRecord record;
+        log_cache_read_record(data->cache, row, &record);
+        count_record(data, worker, &record);
+    }
+}
+
+// False if the block filters show that no line of block has the -ip or
+// -url key.
+static bool block_may_match(ThreadData* data, WorkerState* worker, const WorkBlock* block) {
+    size_t start_offset = data->data_offset + block->start_offset;
+    size_t end_offset = data->data_offset + block->end_offset;
+    if (data->ip_filter != NULL
+        && !block_filter_may_contain(data->block_filter, start_offset, end_offset, BLOCK_FILTER_IP,
+                                     worker->ip_filter_hash)) {
+        return false;
+    }
+    if (data->url_filter != NULL
+        && !block_filter_may_contain(data->block_filter, start_offset, end_offset, BLOCK_FILTER_URL,
+                                     worker->url_filter_hash)) {
+        return false;
+    }
+    return true;
+}
+
+void* process_log_chunk(void* arg) {
+    ThreadData* data = (ThreadData*)arg;
+
+    if (data->cpu >= 0 && !pin_current_thread(data->cpu)) {
+        fprintf(stderr, "Warning: Failed to pin worker to CPU %d\n", data->cpu);
+    }
+
+    // Allocated only after pinning so that first touch places the pages on
+    // the worker's own NUMA node.
+    init_analyzer_stats(data->stats, data->options);
+
+    int nmatch = 9;
+    WorkerState worker;
+    worker.matches = create_regex_matches(nmatch);
+    worker.time_cache.len = 0;
+    worker.ip_filter_is_address = data->ip_filter != NULL
+        && parse_ip_key(data->ip_filter, strlen(data->ip_filter), &worker.ip_filter_key);
+    worker.ip_filter_hash = 0;
+    if (data->ip_filter != NULL) {
+        worker.ip_filter_hash = worker.ip_filter_is_address ? ip_key_hash(&worker.ip_filter_key)
+                                                            : hash_bytes(data->ip_filter, strlen(data->ip_filter));
+    }
+    worker.url_filter_hash = data->url_filter != NULL ? hash_bytes(data->url_filter, strlen(data->url_filter)) : 0;
+    worker.group_key = NULL;
+    worker.group_key_capacity = 0;
+    worker.url_buffer = NULL;
+    worker.url_buffer_capacity = 0;
+
+    WorkBlock block;
+    while (scheduler_next_block(data->scheduler, data->worker_index, &block)) {
+        if (data->block_filter != NULL && !block_may_match(data, &worker, &block)) {
+            continue;
+        }
+        if (data->cache_builder != NULL) {
+            log_cache_builder_begin_block(data->cache_builder, data->data_offset + block.start_offset);
+        }
+        if (data->cache != NULL) {
+            process_cache_rows(data, &worker, block.start_offset, block.end_offset);
+        } else {
+            process_log_block(data, &worker, block.start_offset, block.end_offset);
+        }
+    }
+
+    free_regex_matches(worker.matches);
+    free(worker.group_key);
+    free(worker.url_buffer);
+
+    return NULL;
+}
+
+// Summary keys for -approx: a 0 byte followed by the address in network
+// order, or a 1 byte followed by the text of a non-address client field.
+static size_t make_ip_approx_key(StrSpan ip, const IpKey* key, char* buffer, size_t buffer_size) {
+    if (key != NULL) {
+        buffer[0] = 0;
+        for (int i = 0; i < 8; i++) {
+            buffer[1 + i] = (char)(key->hi >> (56 - 8 * i));
+            buffer[9 + i] = (char)(key->lo >> (56 - 8 * i));
+        }
+        return 17;
     }
 
-    if (stats->url_stats.size >= stats->url_stats.capacity) {
-        int new_capacity = stats->url_stats.capacity == 0 ? 100 : stats->url_stats.capacity * 2;
-        stats->url_stats.urls = (char**)realloc(stats->url_stats.urls, new_capacity * sizeof(char*));
-        stats->url_stats.counts = (int*)realloc(stats->url_stats.counts, new_capacity * sizeof(int));
-        stats->url_stats.capacity = new_capacity;
+    size_t len = ip.len < buffer_size - 1 ? ip.len : buffer_size - 1;
+    buffer[0] = 1;
+    memcpy(buffer + 1, ip.ptr, len);
+    return len + 1;
+}
+
+// What one request adds to an -approx summary.
+static int64_t approx_weight(const AnalyzerStats* stats, int64_t bytes) {
+    return stats->options.rank_by_bytes ? bytes : 1;
+}
+
+// key is the parsed address, or NULL when the field is not an address.
+void update_ip_stats(AnalyzerStats* stats, StrSpan ip, const IpKey* key, uint64_t hash, int64_t bytes) {
+    if (stats->options.approx_counters > 0) {
+        char buffer[256];
+        size_t len = make_ip_approx_key(ip, key, buffer, sizeof(buffer));
+        space_saving_add(&stats->ip_approx, buffer, len, hash_bytes(buffer, len), approx_weight(stats, bytes));
+    } else if (key != NULL) {
+        ip_table_add(&stats->ip_stats, key, hash, 1, bytes);
+    } else {
+        counter_table_add(&stats->host_stats, ip.ptr, ip.len, hash, 1, bytes);
     }
+}
 
-    stats->url_stats.urls[stats->url_stats.size] = _strdup(url);
-    stats->url_stats.counts[stats->url_stats.size] = 1;
-    stats->url_stats.size++;
+void update_url_stats(AnalyzerStats* stats, StrSpan url, uint64_t hash, int64_t bytes) {
+    if (stats->options.approx_counters > 0) {
+        space_saving_add(&stats->url_approx, url.ptr, url.len, hash, approx_weight(stats, bytes));
+        return;
+    }
+    counter_table_add(&stats->url_stats, url.ptr, url.len, hash, 1, bytes);
 }
 
-void update_response_code_stats(AnalyzerStats* stats, int code) {
+void update_response_code_stats(AnalyzerStats* stats, int code, int64_t bytes) {
     if (code >= 0 && code < 600) {
         stats->response_codes[code]++;
+        stats->response_bytes[code] += bytes;
     }
 }
 
-void update_useragent_stats(AnalyzerStats* stats, const char* useragent) {
-    // Check if User-Agent already exists
-    for (int i = 0; i < stats->useragent_stats.size; i++) {
-        if (strcmp(stats->useragent_stats.useragents[i], useragent) == 0) {
-            stats->useragent_stats.counts[i]++;
-            return;
+void update_useragent_stats(AnalyzerStats* stats, StrSpan useragent, uint64_t hash, int64_t bytes) {
+    if (stats->options.approx_counters > 0) {
+        space_saving_add(&stats->useragent_approx, useragent.ptr, useragent.len, hash, approx_weight(stats, bytes));
+        return;
+    }
+    counter_table_add(&stats->useragent_stats, useragent.ptr, useragent.len, hash, 1, bytes);
+}
+
+// Hour of day shown in the log line itself, i.e. in the zone of the server
+// that wrote it.
+int log_time_hour(const LogTime* time) {
+    long long local = (long long)time->epoch + time->utc_offset;
+    long long second_of_day = local % 86400;
+    if (second_of_day < 0) {
+        second_of_day += 86400;
+    }
+    return (int)(second_of_day / 3600);
+}
+
+// Index into per-class breakdowns: code / 100, or 0 outside 100-599.
+static int status_class(int code) {
+    return code >= 100 && code < 600 ? code / 100 : 0;
+}
+
+void update_time_stats(AnalyzerStats* stats, const LogTime* time, int code, int64_t bytes) {
+    stats->time_stats.counts_per_hour[log_time_hour(time)]++;
+    if (stats->options.bucket_width > 0) {
+        time_series_add(&stats->time_stats.series, (int64_t)time->epoch + time->utc_offset, status_class(code), bytes);
+    }
+}
+
+// hour is -1 for lines whose timestamp could not be parsed.
+void update_distinct_stats(AnalyzerStats* stats, uint64_t ip_hash, uint64_t url_hash, uint64_t useragent_hash, int hour) {
+    hyperloglog_add(&stats->distinct_total.ips, ip_hash);
+    hyperloglog_add(&stats->distinct_total.urls, url_hash);
+    hyperloglog_add(&stats->distinct_total.useragents, useragent_hash);
+
+    if (hour >= 0) {
+        DistinctCounts* counts = &stats->distinct_per_hour[hour];
+        hyperloglog_add(&counts->ips, ip_hash);
+        hyperloglog_add(&counts->urls, url_hash);
+        hyperloglog_add(&counts->useragents, useragent_hash);
+    }
+}
+
+void update_size_stats(AnalyzerStats* stats, int code, int64_t size, uint64_t url_hash) {
+    ddsketch_add(&stats->size_total, size);
+    ddsketch_add(&stats->size_per_class[status_class(code)], size);
+    if (stats->options.approx_counters == 0) {
+        ddsketch_table_add(&stats->size_per_url, url_hash, size);
+    }
+}
+
+// Ranked by bytes, a line shows both totals; otherwise just the count.
+static void print_ranked_line(int rank, const char* key, const char* suffix, int64_t count, int64_t bytes,
+                              bool by_bytes) {
+    if (by_bytes) {
+        printf("%d. %s%s: %lld bytes, %lld requests\n", rank, key, suffix, (long long)bytes, (long long)count);
+    } else {
+        printf("%d. %s%s: %lld\n", rank, key, suffix, (long long)count);
+    }
+}
+
+const char* group_field_name(GroupField field) {
+    static const char* names[] = {"ip", "method", "url", "code", "class", "hour", "ua", "referer"};
+    return names[field];
+}
+
+static void append_group_value(char** buffer, size_t* capacity, size_t* len, const char* value, size_t value_len) {
+    if (*len + value_len + 1 > *capacity) {
+        size_t new_capacity = *capacity > 0 ? *capacity : 256;
+        while (*len + value_len + 1 > new_capacity) {
+            new_capacity *= 2;
         }
+        *buffer = (char*)realloc(*buffer, new_capacity);
+        *capacity = new_capacity;
     }
+    memcpy(*buffer + *len, value, value_len);
+    *len += value_len;
+}
 
-    if (stats->useragent_stats.size >= stats->useragent_stats.capacity) {
-        int new_capacity = stats->useragent_stats.capacity == 0 ? 100 : stats->useragent_stats.capacity * 2;
-        stats->useragent_stats.useragents = (char**)realloc(stats->useragent_stats.useragents, new_capacity * sizeof(char*));
-        stats->useragent_stats.counts = (int*)realloc(stats->useragent_stats.counts, new_capacity * sizeof(int));
-        stats->useragent_stats.capacity = new_capacity;
+// Decimal digits of a non-negative value, zero-padded to min_digits.
+static void append_group_number(char** buffer, size_t* capacity, size_t* len, int value, int min_digits) {
+    char digits[12];
+    int count = 0;
+    do {
+        digits[sizeof(digits) - 1 - count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0 || count < min_digits);
+    append_group_value(buffer, capacity, len, digits + sizeof(digits) - count, (size_t)count);
+}
+
+// Joins the selected fields of record with tabs into *buffer, growing it as
+// needed, and returns the key length. A client address is written in its
+// canonical form, so every spelling of it falls into one group, as in the
+// IP counts.
+size_t build_group_key(const AnalyzerOptions* options, const LogRecord* record, char** buffer, size_t* capacity) {
+    const LogEntry* entry = &record->entry;
+    int hour = record->has_time ? log_time_hour(&record->time) : -1;
+    char address[IP_KEY_TEXT_SIZE];
+    size_t len = 0;
+    for (int i = 0; i < options->num_group_fields; i++) {
+        if (i > 0) {
+            append_group_value(buffer, capacity, &len, "\t", 1);
+        }
+
+        switch (options->group_fields[i]) {
+            case GROUP_FIELD_IP:
+                if (record->ip_is_address) {
+                    format_ip_key(&record->ip_key, address, sizeof(address));
+                    append_group_value(buffer, capacity, &len, address, strlen(address));
+                } else {
+                    append_group_value(buffer, capacity, &len, entry->ip.ptr, entry->ip.len);
+                }
+                break;
+            case GROUP_FIELD_METHOD:
+                append_group_value(buffer, capacity, &len, entry->method.ptr, entry->method.len);
+                break;
+            case GROUP_FIELD_URL:
+                append_group_value(buffer, capacity, &len, entry->url.ptr, entry->url.len);
+                break;
+            case GROUP_FIELD_CODE:
+                append_group_number(buffer, capacity, &len, entry->code, 1);
+                break;
+            case GROUP_FIELD_CLASS:
+                if (status_class(entry->code) > 0) {
+                    append_group_number(buffer, capacity, &len, status_class(entry->code), 1);
+                    append_group_value(buffer, capacity, &len, "xx", 2);
+                } else {
+                    append_group_value(buffer, capacity, &len, "other", 5);
+                }
+                break;
+            case GROUP_FIELD_HOUR:
+                if (hour >= 0) {
+                    append_group_number(buffer, capacity, &len, hour, 2);
+                } else {
+                    append_group_value(buffer, capacity, &len, "-", 1);
+                }
+                break;
+            case GROUP_FIELD_USERAGENT:
+                append_group_value(buffer, capacity, &len, entry->useragent.ptr, entry->useragent.len);
+                break;
+            case GROUP_FIELD_REFERER:
+                append_group_value(buffer, capacity, &len, entry->referer.ptr, entry->referer.len);
+                break;
+        }
     }
+    return len;
+}
 
-    stats->useragent_stats.useragents[stats->useragent_stats.size] = _strdup(useragent);
-    stats->useragent_stats.counts[stats->useragent_stats.size] = 1;
-    stats->useragent_stats.size++;
+void update_group_stats(AnalyzerStats* stats, StrSpan key, int64_t bytes) {
+    uint64_t hash = hash_bytes(key.ptr, key.len);
+    if (stats->options.approx_counters > 0) {
+        space_saving_add(&stats->group_approx, key.ptr, key.len, hash, approx_weight(stats, bytes));
+        return;
+    }
+    counter_table_add(&stats->group_stats, key.ptr, key.len, hash, 1, bytes);
 }
 
-void update_time_stats(AnalyzerStats* stats, const char* datetime) {
-    time_t timestamp = parse_datetime(datetime);
-    if (timestamp == 0) {
+void print_top_n(CounterTable* table, int n, const char* title, bool by_bytes, int num_threads) {
+    printf("\n----- %s -----\n", title);
+
+    if (n <= 0) {
         return;
     }
 
-    struct tm* tm_info = localtime(&timestamp);
-    if (tm_info != NULL) {
-        stats->time_stats.counts_per_hour[tm_info->tm_hour]++;
+    CounterSlot** items = (CounterSlot**)malloc(n * sizeof(CounterSlot*));
+    int count = counter_table_top_n(table, n, by_bytes, num_threads, items);
+    for (int i = 0; i < count; i++) {
+        print_ranked_line(i + 1, items[i]->key, "", items[i]->count, items[i]->bytes, by_bytes);
     }
+
+    free(items);
 }
 
-void print_top_n(char** items, int* counts, int size, int n, const char* title) {
+// Addresses and host names are ranked together; on equal counts (or byte
+// totals with -bytes) addresses come first.
+void print_top_ips(AnalyzerStats* stats, int n, const char* title, int num_threads) {
     printf("\n----- %s -----\n", title);
 
-    int* indices = (int*)malloc(size * sizeof(int));
-    for (int i = 0; i < size; i++) {
-        indices[i] = i;
+    if (n <= 0) {
+        return;
+    }
+
+    bool by_bytes = stats->options.rank_by_bytes;
+    IpCounterSlot** ips = (IpCounterSlot**)malloc(n * sizeof(IpCounterSlot*));
+    CounterSlot** hosts = (CounterSlot**)malloc(n * sizeof(CounterSlot*));
+    int num_ips = ip_table_top_n(&stats->ip_stats, n, by_bytes, num_threads, ips);
+    int num_hosts = counter_table_top_n(&stats->host_stats, n, by_bytes, num_threads, hosts);
+
+    int i = 0, j = 0;
+    for (int rank = 1; rank <= n && (i < num_ips || j < num_hosts); rank++) {
+        bool ip_first = j == num_hosts
+            || (i < num_ips && (by_bytes ? ips[i]->bytes >= hosts[j]->bytes : ips[i]->count >= hosts[j]->count));
+        if (ip_first) {
+            char address[IP_KEY_TEXT_SIZE];
+            format_ip_key(&ips[i]->key, address, sizeof(address));
+            print_ranked_line(rank, address, "", ips[i]->count, ips[i]->bytes, by_bytes);
+            i++;
+        } else {
+            print_ranked_line(rank, hosts[j]->key, "", hosts[j]->count, hosts[j]->bytes, by_bytes);
+            j++;
+        }
+    }
+
+    free(ips);
+    free(hosts);
+}
+
+void print_top_nets(NetRollup* rollup, int n, bool by_bytes, int num_threads) {
+    printf("\n----- Top %s Networks (/%d) -----\n", rollup->v4 ? "IPv4" : "IPv6", rollup->prefix_len);
+
+    if (n <= 0) {
+        return;
+    }
+
+    IpCounterSlot** nets = (IpCounterSlot**)malloc(n * sizeof(IpCounterSlot*));
+    int count = ip_table_top_n(&rollup->table, n, by_bytes, num_threads, nets);
+    for (int i = 0; i < count; i++) {
+        char address[IP_KEY_TEXT_SIZE];
+        char prefix[8];
+        format_ip_key(&nets[i]->key, address, sizeof(address));
+        snprintf(prefix, sizeof(prefix), "/%d", rollup->prefix_len);
+        print_ranked_line(i + 1, address, prefix, nets[i]->count, nets[i]->bytes, by_bytes);
+    }
+
+    free(nets);
+}
+
+// Counts are upper bounds; the error column is how far each may be over.
+// With by_bytes the summary was weighted by bytes sent.
+void print_top_approx(SpaceSaving* ss, int n, const char* title, bool ip_keys, bool by_bytes) {
+    const char* unit = by_bytes ? " bytes" : "";
+    printf("\n----- %s (approximate) -----\n", title);
+    printf("%lld%s, %d counters, error at most %lld%s\n", (long long)ss->total, by_bytes ? " bytes" : " entries",
+           ss->capacity, (long long)space_saving_max_error(ss), unit);
+
+    if (n <= 0) {
+        return;
     }
 
-    for (int i = 0; i < size - 1; i++) {
-        for (int j = i + 1; j < size; j++) {
-            if (counts[indices[i]] < counts[indices[j]]) {
-                int temp = indices[i];
-                indices[i] = indices[j];
-                indices[j] = temp;
+    HeavyHitter** items = (HeavyHitter**)malloc(n * sizeof(HeavyHitter*));
+    int count = space_saving_top_n(ss, n, items);
+    for (int i = 0; i < count; i++) {
+        const char* key = items[i]->key;
+        char address[IP_KEY_TEXT_SIZE];
+        if (ip_keys && items[i]->key_len == 17 && key[0] == 0) {
+            IpKey ip_key = {0, 0};
+            for (int j = 0; j < 8; j++) {
+                ip_key.hi = ip_key.hi << 8 | (unsigned char)key[1 + j];
+                ip_key.lo = ip_key.lo << 8 | (unsigned char)key[9 + j];
             }
+            format_ip_key(&ip_key, address, sizeof(address));
+            key = address;
+        } else if (ip_keys) {
+            key++;
+        }
+        printf("%d. %s: %lld%s (error <= %lld)\n", i + 1, key, (long long)items[i]->count, unit,
+               (long long)items[i]->error);
+    }
+
+    free(items);
+}
+
+void print_distinct_stats(AnalyzerStats* stats) {
+    printf("\n----- Unique Counts (approximate) -----\n");
+    printf("IP addresses: %.0f\n", hyperloglog_estimate(&stats->distinct_total.ips));
+    printf("URLs: %.0f\n", hyperloglog_estimate(&stats->distinct_total.urls));
+    printf("User agents: %.0f\n", hyperloglog_estimate(&stats->distinct_total.useragents));
+    printf("Unique per hour:\n");
+    for (int i = 0; i < 24; i++) {
+        DistinctCounts* counts = &stats->distinct_per_hour[i];
+        printf("%02d:00 - %02d:59: %.0f IPs, %.0f URLs, %.0f user agents\n", i, i,
+               hyperloglog_estimate(&counts->ips), hyperloglog_estimate(&counts->urls),
+               hyperloglog_estimate(&counts->useragents));
+    }
+}
+
+// Finishes a line that the caller started with its label.
+static void print_size_quantiles(const DDSketch* sketch) {
+    printf(": %lld responses, p50 %.0f, p90 %.0f, p99 %.0f, p99.9 %.0f, max %lld\n",
+           (long long)sketch->count, ddsketch_quantile(sketch, 0.5), ddsketch_quantile(sketch, 0.9),
+           ddsketch_quantile(sketch, 0.99), ddsketch_quantile(sketch, 0.999), (long long)sketch->max);
+}
+
+// Quantiles of bytes sent; the per-URL lines follow the -topurl ranking.
+void print_size_stats(AnalyzerStats* stats, int top_url, int num_threads) {
+    printf("\n----- Response Sizes (within %.0f%%) -----\n", DDSKETCH_RELATIVE_ACCURACY * 100);
+    printf("All");
+    print_size_quantiles(&stats->size_total);
+
+    const char* class_labels[6] = {"Other", "1xx", "2xx", "3xx", "4xx", "5xx"};
+    // 1xx to 5xx first, codes outside them last.
+    for (int k = 1; k <= 6; k++) {
+        int i = k % 6;
+        if (stats->size_per_class[i].count > 0) {
+            printf("%s", class_labels[i]);
+            print_size_quantiles(&stats->size_per_class[i]);
         }
     }
 
-    int count = n < size ? n : size;
+    if (stats->options.approx_counters > 0 || top_url <= 0) {
+        return;
+    }
+
+    printf("Top URLs:\n");
+    CounterSlot** items = (CounterSlot**)malloc(top_url * sizeof(CounterSlot*));
+    int count = counter_table_top_n(&stats->url_stats, top_url, stats->options.rank_by_bytes, num_threads, items);
     for (int i = 0; i < count; i++) {
-        printf("%d. %s: %d\n", i + 1, items[indices[i]], counts[indices[i]]);
+        const DDSketch* sketch = ddsketch_table_find(&stats->size_per_url, items[i]->hash);
+        if (sketch != NULL) {
+            printf("%d. %s", i + 1, items[i]->key);
+            print_size_quantiles(sketch);
+        }
     }
 
-    free(indices);
+    free(items);
 }
 
-void print_response_code_stats(int* codes, const char* title) {
+static void print_response_code(int code, const int64_t* codes, const int64_t* bytes) {
+    if (bytes != NULL) {
+        printf("%d: %lld (%lld bytes)\n", code, (long long)codes[code], (long long)bytes[code]);
+    } else {
+        printf("%d: %lld\n", code, (long long)codes[code]);
+    }
+}
+
+// Group keys are printed as stored, one tab between field values.
+void print_group_stats(AnalyzerStats* stats, int n, int num_threads) {
+    char title[128] = "Top Groups (";
+    for (int i = 0; i < stats->options.num_group_fields; i++) {
+        if (i > 0) {
+            strcat(title, ", ");
+        }
+        strcat(title, group_field_name(stats->options.group_fields[i]));
+    }
+    strcat(title, stats->options.rank_by_bytes ? ") by Bytes" : ")");
+
+    if (stats->options.approx_counters > 0) {
+        print_top_approx(&stats->group_approx, n, title, false, stats->options.rank_by_bytes);
+    } else {
+        print_top_n(&stats->group_stats, n, title, stats->options.rank_by_bytes, num_threads);
+    }
+}
+
+// Every bucket from the first to the last one with requests, empty ones
+// included, so that gaps show up.
+void print_time_series(AnalyzerStats* stats) {
+    TimeSeries* series = &stats->time_stats.series;
+    char width[32];
+    format_series_width(series->width, width, sizeof(width));
+    printf("\n----- Time Series (%s buckets) -----\n", width);
+
+    size_t first = 0;
+    size_t last = series->num_buckets;
+    while (first < last && series->buckets[first].requests == 0) {
+        first++;
+    }
+    while (last > first && series->buckets[last - 1].requests == 0) {
+        last--;
+    }
+
+    for (size_t i = first; i < last; i++) {
+        const TimeBucket* bucket = &series->buckets[i];
+        char start[32];
+        format_series_time(series->origin + (int64_t)i * series->width, start, sizeof(start));
+        printf("%s: %lld requests, %lld bytes, 1xx %lld, 2xx %lld, 3xx %lld, 4xx %lld, 5xx %lld", start,
+               (long long)bucket->requests, (long long)bucket->bytes,
+               (long long)bucket->status_classes[1], (long long)bucket->status_classes[2],
+               (long long)bucket->status_classes[3], (long long)bucket->status_classes[4],
+               (long long)bucket->status_classes[5]);
+        if (bucket->status_classes[0] > 0) {
+            printf(", other %lld", (long long)bucket->status_classes[0]);
+        }
+        printf("\n");
+    }
+
+    if (series->dropped > 0) {
+        printf("%lld requests fell outside the %lld-bucket range and were not counted\n",
+               (long long)series->dropped, (long long)TIME_SERIES_MAX_BUCKETS);
+    }
+}
+
+// bytes may be NULL to print request counts only.
+void print_response_code_stats(const int64_t* codes, const int64_t* bytes, const char* title) {
     printf("\n----- %s -----\n", title);
 
     int common_codes[] = {200, 201, 204, 206, 301, 302, 303, 304, 307, 400, 401, 403, 404, 405, 406, 410, 500, 501, 502, 503, 504};
@@ -387,7 +1259,7 @@ void print_response_code_stats(int* codes, const char* title) {
     for (int i = 0; i < num_common_codes; i++) {
         int code = common_codes[i];
         if (codes[code] > 0) {
-            printf("%d: %d\n", code, codes[code]);
+            print_response_code(code, codes, bytes);
         }
     }
 
@@ -402,33 +1274,101 @@ void print_response_code_stats(int* codes, const char* title) {
             }
 
             if (!is_common) {
-                printf("%d: %d\n", code, codes[code]);
+                print_response_code(code, codes, bytes);
             }
         }
     }
 }
 
-time_t parse_datetime(const char* datetime) {
-    struct tm tm_info = {0};
-    char month_str[4];
-    int timezone_offset;
-
-    sscanf(datetime, "%d/%3s/%d:%d:%d:%d %d", 
-           &tm_info.tm_mday, month_str, &tm_info.tm_year, 
-           &tm_info.tm_hour, &tm_info.tm_min, &tm_info.tm_sec, 
-           &timezone_offset);
+static bool parse_fixed_digits(const char* p, int count, int* value) {
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if (p[i] < '0' || p[i] > '9') {
+            return false;
+        }
+        result = result * 10 + (p[i] - '0');
+    }
+    *value = result;
+    return true;
+}
 
-    const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+static int parse_month(const char* p) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
     for (int i = 0; i < 12; i++) {
-        if (strncmp(month_str, months[i], 3) == 0) {
-            tm_info.tm_mon = i;
-            break;
+        if (p[0] == months[i * 3] && p[1] == months[i * 3 + 1] && p[2] == months[i * 3 + 2]) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Days between 1970-01-01 and the given civil date in the proleptic
+// Gregorian calendar.
+static long long days_from_civil(int year, int month, int day) {
+    year -= month <= 2;
+    long long era = (year >= 0 ? year : year - 399) / 400;
+    long long year_of_era = year - era * 400;
+    long long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+// Decodes the fixed CLF layout "dd/Mon/yyyy:HH:MM:SS +hhmm". The zone is
+// optional and taken as UTC when missing.
+bool parse_log_time(StrSpan datetime, LogTime* time) {
+    const char* p = datetime.ptr;
+    if (datetime.len < 20 || p[2] != '/' || p[6] != '/' || p[11] != ':' || p[14] != ':' || p[17] != ':') {
+        return false;
+    }
+
+    int day, year, hour, minute, second;
+    int month = parse_month(p + 3);
+    if (month == 0 || !parse_fixed_digits(p, 2, &day) || !parse_fixed_digits(p + 7, 4, &year) ||
+        !parse_fixed_digits(p + 12, 2, &hour) || !parse_fixed_digits(p + 15, 2, &minute) ||
+        !parse_fixed_digits(p + 18, 2, &second)) {
+        return false;
+    }
+
+    if (day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) {
+        return false;
+    }
+
+    int offset = 0;
+    if (datetime.len >= 26 && p[20] == ' ' && (p[21] == '+' || p[21] == '-')) {
+        int zone_hours, zone_minutes;
+        if (!parse_fixed_digits(p + 22, 2, &zone_hours) || !parse_fixed_digits(p + 24, 2, &zone_minutes)) {
+            return false;
+        }
+        offset = zone_hours * 3600 + zone_minutes * 60;
+        if (p[21] == '-') {
+            offset = -offset;
         }
     }
 
-    tm_info.tm_year -= 1900;
+    long long local = days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    time->epoch = (time_t)(local - offset);
+    time->utc_offset = offset;
+    return true;
+}
+
+// Same as parse_log_time, but reuses the previous result when the line
+// carries the same timestamp text as the one before it.
+bool parse_log_time_cached(TimestampCache* cache, StrSpan datetime, LogTime* time) {
+    if (cache->len != 0 && cache->len == datetime.len && memcmp(cache->text, datetime.ptr, datetime.len) == 0) {
+        *time = cache->time;
+        return true;
+    }
 
-    return mktime(&tm_info);
+    if (!parse_log_time(datetime, time)) {
+        return false;
+    }
+
+    if (datetime.len <= sizeof(cache->text)) {
+        memcpy(cache->text, datetime.ptr, datetime.len);
+        cache->len = datetime.len;
+        cache->time = *time;
+    }
+    return true;
 }
 
 void print_usage() {
@@ -440,9 +1380,29 @@ void print_usage() {
     printf("  -topip <n>             Show top N IP addresses\n");
     printf("  -topurl <n>            Show top N URLs\n");
     printf("  -topua <n>             Show top N User Agents\n");
+    printf("  -topnet </len,...>     Show top IPv4 networks for each prefix length (e.g. /24,/16)\n");
+    printf("  -topnet6 </len,...>    Show top IPv6 networks for each prefix length (e.g. /48)\n");
+    printf("  -topnetn <n>           Number of networks to show per prefix length (default: 10)\n");
+    printf("  -approx <k>            Approximate top IP/URL/UA with k counters each (bounded memory)\n");
+    printf("  -normurl               Collapse numeric, UUID and hex URL path segments and strip query strings\n");
+    printf("  -query <mode>          Query string handling: keep, strip or sort (default: keep, strip with -normurl)\n");
+    printf("  -routes <file>         Count URLs under route templates such as /api/users/{id}, one per line\n");
+    printf("  -cache                 Keep parsed rows in <log>.hpcache and reuse them while the log is unchanged\n");
+    printf("  -bloom                 Keep per-block Bloom filters in <log>.hpbloom to skip blocks without the -ip/-url key\n");
     printf("  -ip <ip>               Filter by IP address\n");
     printf("  -url <url>             Filter by URL\n");
+    printf("  -ipset <file>          Count only clients in a list of addresses and CIDR blocks, one per line\n");
+    printf("  -notipset <file>       Skip clients in a list of addresses and CIDR blocks\n");
+    printf("  -where <expr>          Count only lines matching an expression, e.g. 'code >= 500 && url ^= \"/api/\"'\n");
     printf("  -time stats            Enable time-based statistics\n");
+    printf("  -unique                Estimate unique IPs, URLs and User Agents overall and per hour\n");
+    printf("  -bytes                 Rank top lists by bytes sent and show byte totals\n");
+    printf("  -sizes                 Show response size percentiles overall, per status class and per top URL\n");
+    printf("  -threads <n>           Number of worker threads (default: available CPUs)\n");
+    printf("  -pin                   Pin each worker thread to its own CPU\n");
+    printf("  -groupby <fields>      Count requests per combination of fields: ip, method, url, code, class, hour, ua, referer\n");
+    printf("  -topgroup <n>          Number of groups to show (default: 10)\n");
+    printf("  -bucket <width>        Show a time series with 1s, 10s, 1m, 1h or 1d buckets (any <n>s|m|h|d)\n");
     printf("  -start <datetime>      Start time filter (format: YYYY-MM-DD HH:MM:SS)\n");
     printf("  -end <datetime>        End time filter (format: YYYY-MM-DD HH:MM:SS)\n");
     printf("  -h                     Show this help message\n");
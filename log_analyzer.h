@@ -2,95 +2,241 @@
 #define LOG_ANALYZER_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "regex.h"
+#include "hash_table.h"
+#include "ip_table.h"
+#include "space_saving.h"
+#include "hyperloglog.h"
+#include "ddsketch.h"
+#include "time_series.h"
+#include "url_normalizer.h"
+#include "ip_set.h"
+#include "scheduler.h"
 
+// Non-owning view into the line being parsed.
 typedef struct {
-    char* ip;
-    char* datetime;
-    char* method;
-    char* url;
+    const char* ptr;
+    size_t len;
+} StrSpan;
+
+typedef struct {
+    StrSpan ip;
+    StrSpan datetime;
+    StrSpan method;
+    StrSpan url;
     int code;
-    long size;
-    char* referer;
-    char* useragent;
+    int64_t size;
+    StrSpan referer;
+    StrSpan useragent;
 } LogEntry;
 
+// Request time as UTC epoch seconds plus the zone offset written in the log.
+typedef struct {
+    time_t epoch;
+    int utc_offset;
+} LogTime;
+
+// A parsed line with the values the aggregation derives from it. The hashes
+// are 0 until computed; records read back from a cache carry them.
+typedef struct {
+    LogEntry entry;
+    bool ip_is_address;
+    IpKey ip_key;
+    bool has_time;
+    LogTime time;
+    uint64_t ip_hash;
+    uint64_t url_hash;
+    uint64_t useragent_hash;
+} LogRecord;
+
+// Last timestamp decoded by a worker; consecutive lines usually share it.
+typedef struct {
+    char text[32];
+    size_t len;
+    LogTime time;
+} TimestampCache;
+
+typedef enum {
+    FAST_PARSER_NONE,
+    FAST_PARSER_COMMON,
+    FAST_PARSER_COMBINED
+} FastParserKind;
+
 typedef struct {
     char* name;
     char* pattern;
     regex_t regex;
+    FastParserKind fast_parser;
 } LogFormat;
 
 typedef struct {
     regmatch_t* matches;
     int nmatch;
+    char* line_buffer;
+    size_t line_capacity;
 } RegexMatches;
 
+// Fields that -groupby can combine into one key.
+typedef enum {
+    GROUP_FIELD_IP,
+    GROUP_FIELD_METHOD,
+    GROUP_FIELD_URL,
+    GROUP_FIELD_CODE,
+    GROUP_FIELD_CLASS,
+    GROUP_FIELD_HOUR,
+    GROUP_FIELD_USERAGENT,
+    GROUP_FIELD_REFERER
+} GroupField;
+
+#define MAX_GROUP_FIELDS 8
+
+// Per-run settings that change what the workers collect.
 typedef struct {
-    struct {
-        char** ips;
-        int* counts;
-        int size;
-        int capacity;
-    } ip_stats;
+    int approx_counters;
+    bool distinct_counts;
+    bool size_quantiles;
+    bool rank_by_bytes;
+    // Seconds per -bucket time series bucket; 0 when not requested.
+    int bucket_width;
+    GroupField group_fields[MAX_GROUP_FIELDS];
+    int num_group_fields;
+} AnalyzerOptions;
 
-    struct {
-        char** urls;
-        int* counts;
-        int size;
-        int capacity;
-    } url_stats;
+typedef struct {
+    HyperLogLog ips;
+    HyperLogLog urls;
+    HyperLogLog useragents;
+} DistinctCounts;
 
-    int response_codes[600];
+typedef struct {
+    AnalyzerOptions options;
 
-    struct {
-        char** useragents;
-        int* counts;
-        int size;
-        int capacity;
-    } useragent_stats;
+    IpCounterTable ip_stats;
+    // Client fields that are not numeric addresses, e.g. resolved host names.
+    CounterTable host_stats;
+    CounterTable url_stats;
+
+    int64_t response_codes[600];
+    int64_t response_bytes[600];
+
+    CounterTable useragent_stats;
 
     struct {
         time_t start_time;
         time_t end_time;
-        int* counts_per_hour;
+        int64_t* counts_per_hour;
+        // With -bucket: requests, bytes and status classes over the actual
+        // time range, in the clock written in the log.
+        TimeSeries series;
     } time_stats;
 
-    pthread_mutex_t mutex;
+    // With -approx, bounded summaries take the place of the exact IP, URL
+    // and User-Agent tables, which then stay empty. With -bytes they are
+    // weighted by bytes sent instead of by requests.
+    SpaceSaving ip_approx;
+    SpaceSaving url_approx;
+    SpaceSaving useragent_approx;
+
+    // With -unique: distinct clients, URLs and User-Agents overall and per
+    // hour of day, estimated from the key hashes.
+    DistinctCounts distinct_total;
+    DistinctCounts* distinct_per_hour;
+
+    // With -sizes: response sizes overall, per status class (code / 100,
+    // 0 for codes outside 100-599) and per URL hash. The per-URL sketches
+    // are skipped with -approx to keep memory bounded.
+    DDSketch size_total;
+    DDSketch size_per_class[6];
+    DDSketchTable size_per_url;
+
+    // With -groupby: one entry per combination of the selected fields. The
+    // key is the field values joined by tabs; with -approx a summary takes
+    // the place of the table.
+    CounterTable group_stats;
+    SpaceSaving group_approx;
 } AnalyzerStats;
 
 typedef struct {
-    FILE* file;
-    long start_offset;
-    long end_offset;
+    const char* data;
+    size_t data_size;
+    BlockScheduler* scheduler;
+    int worker_index;
     LogFormat* format;
     AnalyzerStats* stats;
     char* ip_filter;
     char* url_filter;
     time_t start_time_filter;
     time_t end_time_filter;
+    int cpu;
+    const AnalyzerOptions* options;
+    // NULL when URLs are counted as written.
+    const UrlNormalizer* url_normalizer;
+    // With -cache: when cache is set the scheduler hands out row ranges of
+    // it instead of byte ranges of data; when cache_builder is set every
+    // parsed line is also recorded for writing a new cache.
+    const struct LogCache* cache;
+    struct LogCacheBuilder* cache_builder;
+    // Offset of data within the log file.
+    size_t data_offset;
+    // With -bloom: blocks that block_filter rules out for the -ip/-url key
+    // are skipped unread; during a full scan block_filter_builder is filled
+    // instead.
+    const struct BlockFilterIndex* block_filter;
+    struct BlockFilterIndex* block_filter_builder;
+    // With -ip or -url: text that every matching line contains, so lines
+    // without it are skipped unparsed; NULL when every line is parsed.
+    const char* prefilter;
+    // With -ipset / -notipset: only addresses in ip_set are counted, and
+    // none in ip_exclude_set; NULL when not given.
+    const IpSet* ip_set;
+    const IpSet* ip_exclude_set;
+    // With -where: the compiled expression every counted line satisfies.
+    const struct FilterExpr* where;
 } ThreadData;
 
 void init_log_formats(LogFormat** formats, int* num_formats);
 void add_log_format(LogFormat** formats, int* num_formats, const char* name, const char* pattern);
 void compile_regex(LogFormat* format);
+StrSpan make_span(const char* ptr, size_t len);
+bool span_equals(StrSpan span, const char* str);
+int64_t span_to_int64(StrSpan span);
 RegexMatches* create_regex_matches(int nmatch);
 void free_regex_matches(RegexMatches* matches);
-bool parse_log_entry(char* line, LogFormat* format, LogEntry* entry, RegexMatches* matches);
-void free_log_entry(LogEntry* entry);
-void init_analyzer_stats(AnalyzerStats* stats);
+bool parse_log_entry(const char* line, size_t line_len, LogFormat* format, LogEntry* entry, RegexMatches* matches);
+void init_analyzer_stats(AnalyzerStats* stats, const AnalyzerOptions* options);
 void free_analyzer_stats(AnalyzerStats* stats);
+void merge_analyzer_stats(AnalyzerStats* dst, AnalyzerStats* src);
+void merge_analyzer_stats_parallel(AnalyzerStats* stats, int count);
+size_t align_to_line_start(const char* data, size_t data_size, size_t offset);
+bool find_log_time_range(const char* data, size_t data_size, LogFormat* format, time_t start_time, time_t end_time,
+                         size_t* start_offset, size_t* end_offset);
 void* process_log_chunk(void* arg);
-void update_ip_stats(AnalyzerStats* stats, const char* ip);
-void update_url_stats(AnalyzerStats* stats, const char* url);
-void update_response_code_stats(AnalyzerStats* stats, int code);
-void update_useragent_stats(AnalyzerStats* stats, const char* useragent);
-void update_time_stats(AnalyzerStats* stats, const char* datetime);
-void print_top_n(char** items, int* counts, int size, int n, const char* title);
-void print_response_code_stats(int* codes, const char* title);
-time_t parse_datetime(const char* datetime);
+void update_ip_stats(AnalyzerStats* stats, StrSpan ip, const IpKey* key, uint64_t hash, int64_t bytes);
+void update_url_stats(AnalyzerStats* stats, StrSpan url, uint64_t hash, int64_t bytes);
+void update_response_code_stats(AnalyzerStats* stats, int code, int64_t bytes);
+void update_useragent_stats(AnalyzerStats* stats, StrSpan useragent, uint64_t hash, int64_t bytes);
+void update_time_stats(AnalyzerStats* stats, const LogTime* time, int code, int64_t bytes);
+void update_distinct_stats(AnalyzerStats* stats, uint64_t ip_hash, uint64_t url_hash, uint64_t useragent_hash, int hour);
+int log_time_hour(const LogTime* time);
+void update_size_stats(AnalyzerStats* stats, int code, int64_t size, uint64_t url_hash);
+size_t build_group_key(const AnalyzerOptions* options, const LogRecord* record, char** buffer, size_t* capacity);
+void update_group_stats(AnalyzerStats* stats, StrSpan key, int64_t bytes);
+void print_top_n(CounterTable* table, int n, const char* title, bool by_bytes, int num_threads);
+void print_top_ips(AnalyzerStats* stats, int n, const char* title, int num_threads);
+void print_top_nets(NetRollup* rollup, int n, bool by_bytes, int num_threads);
+void print_top_approx(SpaceSaving* ss, int n, const char* title, bool ip_keys, bool by_bytes);
+void print_distinct_stats(AnalyzerStats* stats);
+void print_size_stats(AnalyzerStats* stats, int top_url, int num_threads);
+void print_time_series(AnalyzerStats* stats);
+void print_group_stats(AnalyzerStats* stats, int n, int num_threads);
+const char* group_field_name(GroupField field);
+void print_response_code_stats(const int64_t* codes, const int64_t* bytes, const char* title);
+bool parse_log_time(StrSpan datetime, LogTime* time);
+bool parse_log_time_cached(TimestampCache* cache, StrSpan datetime, LogTime* time);
 void print_usage();
 void parse_command_line(int argc, char** argv, char** filename, char** format_name, 
                         int* top_ip, int* top_url, int* top_useragent, 
@@ -0,0 +1,773 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "log_cache.h"
+#include "hash_table.h"
+#include "ip_table.h"
+#include "time_seek.h"
+
+#define LOG_CACHE_VERSION 3
+// Written in native order; a cache made on a machine of the other byte
+// order reads back as a mismatch and is rebuilt.
+#define LOG_CACHE_BYTE_ORDER 0x01020304u
+#define CACHE_DICTIONARY_INITIAL_CAPACITY 1024
+#define CACHE_BUILDER_INITIAL_ROWS 4096
+#define CACHE_WRITE_CHUNK 4096
+// Bytes per row in a builder's spill file: the string ids, epoch, UTC
+// offset, code and size.
+#define CACHE_ROW_SIZE (CACHE_STRING_COLUMNS * sizeof(uint32_t) + 2 * sizeof(int64_t) + 2 * sizeof(int32_t))
+
+static const char cache_magic[8] = {'H', 'P', 'C', 'A', 'C', 'H', 'E', '\0'};
+
+// Start of the file. The sections follow in a fixed order, each padded to a
+// multiple of 8 bytes, so their positions follow from the counts here: for
+// every dictionary its hashes, offsets and text; the parsed IP keys and
+// their flags; then one array per column.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    LogCacheSource source;
+    uint64_t num_rows;
+    uint64_t dictionary_counts[CACHE_STRING_COLUMNS];
+    uint64_t dictionary_text_sizes[CACHE_STRING_COLUMNS];
+    // 1 if no row is more than TIME_SEEK_SLACK older than a row before it.
+    uint32_t time_ordered;
+    uint32_t reserved;
+} LogCacheHeader;
+
+struct CacheDictionaryBuilder {
+    // Open addressing over entry ids + 1; 0 marks an empty slot.
+    uint32_t* index;
+    size_t index_capacity;
+    uint64_t* hashes;
+    // count + 1 entries.
+    uint64_t* offsets;
+    size_t count;
+    size_t capacity;
+    char* text;
+    size_t text_size;
+    size_t text_capacity;
+    // Only kept for the IP dictionary.
+    IpKey* ip_keys;
+    uint8_t* ip_is_address;
+};
+
+bool get_log_cache_source(const char* log_filename, const LogFormat* format, LogCacheSource* source) {
+#ifdef _WIN32
+    struct __stat64 st;
+    if (_stat64(log_filename, &st) != 0 || (st.st_mode & _S_IFREG) == 0) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (stat(log_filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+#endif
+
+    source->size = (uint64_t)st.st_size;
+    source->mtime = (int64_t)st.st_mtime;
+    // The name counts as well: "common" fills in the referer and User-Agent.
+    source->format_hash = hash_bytes(format->pattern, strlen(format->pattern))
+        ^ hash_bytes(format->name, strlen(format->name)) * 31;
+    return true;
+}
+
+static void init_dictionary_builder(CacheDictionaryBuilder* dictionary, bool ip_keys) {
+    dictionary->index_capacity = CACHE_DICTIONARY_INITIAL_CAPACITY;
+    dictionary->index = (uint32_t*)calloc(dictionary->index_capacity, sizeof(uint32_t));
+    dictionary->capacity = CACHE_DICTIONARY_INITIAL_CAPACITY / 2;
+    dictionary->count = 0;
+    dictionary->hashes = (uint64_t*)malloc(dictionary->capacity * sizeof(uint64_t));
+    dictionary->offsets = (uint64_t*)malloc((dictionary->capacity + 1) * sizeof(uint64_t));
+    dictionary->offsets[0] = 0;
+    dictionary->text_capacity = 4096;
+    dictionary->text_size = 0;
+    dictionary->text = (char*)malloc(dictionary->text_capacity);
+    dictionary->ip_keys = NULL;
+    dictionary->ip_is_address = NULL;
+    if (ip_keys) {
+        dictionary->ip_keys = (IpKey*)malloc(dictionary->capacity * sizeof(IpKey));
+        dictionary->ip_is_address = (uint8_t*)malloc(dictionary->capacity);
+    }
+}
+
+static void free_dictionary_builder(CacheDictionaryBuilder* dictionary) {
+    free(dictionary->index);
+    free(dictionary->hashes);
+    free(dictionary->offsets);
+    free(dictionary->text);
+    free(dictionary->ip_keys);
+    free(dictionary->ip_is_address);
+    memset(dictionary, 0, sizeof(*dictionary));
+}
+
+static void grow_dictionary_index(CacheDictionaryBuilder* dictionary) {
+    size_t capacity = dictionary->index_capacity * 2;
+    size_t mask = capacity - 1;
+    uint32_t* index = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+
+    for (size_t id = 0; id < dictionary->count; id++) {
+        size_t i = (size_t)dictionary->hashes[id] & mask;
+        while (index[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        index[i] = (uint32_t)id + 1;
+    }
+
+    free(dictionary->index);
+    dictionary->index = index;
+    dictionary->index_capacity = capacity;
+}
+
+static void grow_dictionary_entries(CacheDictionaryBuilder* dictionary) {
+    dictionary->capacity *= 2;
+    dictionary->hashes = (uint64_t*)realloc(dictionary->hashes, dictionary->capacity * sizeof(uint64_t));
+    dictionary->offsets = (uint64_t*)realloc(dictionary->offsets, (dictionary->capacity + 1) * sizeof(uint64_t));
+    if (dictionary->ip_keys != NULL) {
+        dictionary->ip_keys = (IpKey*)realloc(dictionary->ip_keys, dictionary->capacity * sizeof(IpKey));
+        dictionary->ip_is_address = (uint8_t*)realloc(dictionary->ip_is_address, dictionary->capacity);
+    }
+}
+
+// Returns the id of text, adding it if it is new. ip_key is the parsed
+// address for IP dictionary entries that are one, NULL otherwise.
+static uint32_t dictionary_intern(CacheDictionaryBuilder* dictionary, const char* text, size_t len, uint64_t hash,
+                                  const IpKey* ip_key) {
+    if ((dictionary->count + 1) * 2 > dictionary->index_capacity) {
+        grow_dictionary_index(dictionary);
+    }
+
+    size_t mask = dictionary->index_capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while (dictionary->index[i] != 0) {
+        uint32_t id = dictionary->index[i] - 1;
+        const char* entry = dictionary->text + dictionary->offsets[id];
+        if (dictionary->hashes[id] == hash && dictionary->offsets[id + 1] - dictionary->offsets[id] == len
+            && memcmp(entry, text, len) == 0) {
+            return id;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if (dictionary->count == dictionary->capacity) {
+        grow_dictionary_entries(dictionary);
+    }
+    if (dictionary->text_size + len > dictionary->text_capacity) {
+        while (dictionary->text_size + len > dictionary->text_capacity) {
+            dictionary->text_capacity *= 2;
+        }
+        dictionary->text = (char*)realloc(dictionary->text, dictionary->text_capacity);
+    }
+
+    uint32_t id = (uint32_t)dictionary->count++;
+    if (len > 0) {
+        memcpy(dictionary->text + dictionary->text_size, text, len);
+    }
+    dictionary->text_size += len;
+    dictionary->hashes[id] = hash;
+    dictionary->offsets[id + 1] = dictionary->text_size;
+    if (dictionary->ip_keys != NULL) {
+        dictionary->ip_is_address[id] = ip_key != NULL;
+        if (ip_key != NULL) {
+            dictionary->ip_keys[id] = *ip_key;
+        } else {
+            memset(&dictionary->ip_keys[id], 0, sizeof(IpKey));
+        }
+    }
+    dictionary->index[i] = id + 1;
+    return id;
+}
+
+// The spill file is named after the cache, so it lands on the same disk
+// as the log rather than in a temporary directory that may live in memory.
+void init_log_cache_builder(LogCacheBuilder* builder, const char* cache_filename, int worker) {
+    builder->dictionaries = (CacheDictionaryBuilder*)malloc(CACHE_STRING_COLUMNS * sizeof(CacheDictionaryBuilder));
+    for (int c = 0; c < CACHE_STRING_COLUMNS; c++) {
+        init_dictionary_builder(&builder->dictionaries[c], c == CACHE_COLUMN_IP);
+        builder->ids[c] = NULL;
+    }
+    builder->epochs = NULL;
+    builder->utc_offsets = NULL;
+    builder->codes = NULL;
+    builder->sizes = NULL;
+    builder->num_rows = 0;
+    builder->capacity = 0;
+    builder->runs = NULL;
+    builder->num_runs = 0;
+    builder->runs_capacity = 0;
+
+    size_t name_size = strlen(cache_filename) + 32;
+    builder->spill_filename = (char*)malloc(name_size);
+    snprintf(builder->spill_filename, name_size, "%s.%d.tmp", cache_filename, worker);
+    builder->spill = fopen(builder->spill_filename, "w+b");
+    builder->spill_size = 0;
+    builder->failed = builder->spill == NULL;
+}
+
+void free_log_cache_builder(LogCacheBuilder* builder) {
+    for (int c = 0; c < CACHE_STRING_COLUMNS; c++) {
+        free_dictionary_builder(&builder->dictionaries[c]);
+        free(builder->ids[c]);
+    }
+    free(builder->dictionaries);
+    free(builder->epochs);
+    free(builder->utc_offsets);
+    free(builder->codes);
+    free(builder->sizes);
+    free(builder->runs);
+    if (builder->spill != NULL) {
+        fclose(builder->spill);
+        remove(builder->spill_filename);
+    }
+    free(builder->spill_filename);
+    memset(builder, 0, sizeof(*builder));
+}
+
+static void grow_builder_rows(LogCacheBuilder* builder) {
+    builder->capacity = builder->capacity > 0 ? builder->capacity * 2 : CACHE_BUILDER_INITIAL_ROWS;
+    for (int c = 0; c < CACHE_STRING_COLUMNS; c++) {
+        builder->ids[c] = (uint32_t*)realloc(builder->ids[c], builder->capacity * sizeof(uint32_t));
+    }
+    builder->epochs = (int64_t*)realloc(builder->epochs, builder->capacity * sizeof(int64_t));
+    builder->utc_offsets = (int32_t*)realloc(builder->utc_offsets, builder->capacity * sizeof(int32_t));
+    builder->codes = (int32_t*)realloc(builder->codes, builder->capacity * sizeof(int32_t));
+    builder->sizes = (int64_t*)realloc(builder->sizes, builder->capacity * sizeof(int64_t));
+}
+
+// Columns of a row in file order: the string ids, then the fixed-width
+// fields. A run is spilled in the same order, one column after another.
+typedef enum {
+    ROW_COLUMN_EPOCHS = CACHE_STRING_COLUMNS,
+    ROW_COLUMN_UTC_OFFSETS,
+    ROW_COLUMN_CODES,
+    ROW_COLUMN_SIZES,
+    ROW_COLUMNS
+} RowColumn;
+
+static const void* row_column(const LogCacheBuilder* builder, int column, size_t* width) {
+    switch (column) {
+        case ROW_COLUMN_EPOCHS:
+            *width = sizeof(int64_t);
+            return builder->epochs;
+        case ROW_COLUMN_UTC_OFFSETS:
+            *width = sizeof(int32_t);
+            return builder->utc_offsets;
+        case ROW_COLUMN_CODES:
+            *width = sizeof(int32_t);
+            return builder->codes;
+        case ROW_COLUMN_SIZES:
+            *width = sizeof(int64_t);
+            return builder->sizes;
+        default:
+            *width = sizeof(uint32_t);
+            return builder->ids[column];
+    }
+}
+
+// Sums up the times of the current run and appends its rows to the spill
+// file, leaving the row arrays free for the next block.
+static void flush_builder_run(LogCacheBuilder* builder) {
+    if (builder->num_rows == 0) {
+        return;
+    }
+    CacheRowRun* run = &builder->runs[builder->num_runs - 1];
+    for (size_t row = 0; row < builder->num_rows; row++) {
+        if (builder->utc_offsets[row] == LOG_CACHE_NO_TIME) {
+            continue;
+        }
+        int64_t time = builder->epochs[row];
+        if (run->has_time && time < run->max_time - TIME_SEEK_SLACK) {
+            run->time_ordered = false;
+        }
+        run->min_time = !run->has_time || time < run->min_time ? time : run->min_time;
+        run->max_time = !run->has_time || time > run->max_time ? time : run->max_time;
+        run->has_time = true;
+    }
+
+    for (int c = 0; c < ROW_COLUMNS && !builder->failed; c++) {
+        size_t width;
+        const void* rows = row_column(builder, c, &width);
+        if (fwrite(rows, width, builder->num_rows, builder->spill) != builder->num_rows) {
+            builder->failed = true;
+        }
+    }
+    run->file_offset = builder->spill_size;
+    run->num_rows = builder->num_rows;
+    builder->spill_size += builder->num_rows * CACHE_ROW_SIZE;
+    builder->num_rows = 0;
+}
+
+// Starts a new run; the rows added until the next call come from the
+// block at block_start.
+void log_cache_builder_begin_block(LogCacheBuilder* builder, uint64_t block_start) {
+    flush_builder_run(builder);
+    if (builder->num_runs == builder->runs_capacity) {
+        builder->runs_capacity = builder->runs_capacity > 0 ? builder->runs_capacity * 2 : 64;
+        builder->runs = (CacheRowRun*)realloc(builder->runs, builder->runs_capacity * sizeof(CacheRowRun));
+    }
+    CacheRowRun* run = &builder->runs[builder->num_runs++];
+    memset(run, 0, sizeof(*run));
+    run->block_start = block_start;
+    run->time_ordered = true;
+}
+
+// Adds one parsed line to the current run. The IP, URL and User-Agent hashes are needed for
+// the dictionaries anyway, so they are stored into record for the caller.
+void log_cache_builder_add(LogCacheBuilder* builder, LogRecord* record) {
+    if (builder->num_rows == builder->capacity) {
+        grow_builder_rows(builder);
+    }
+
+    const LogEntry* entry = &record->entry;
+    CacheDictionaryBuilder* dictionaries = builder->dictionaries;
+    size_t row = builder->num_rows++;
+
+    record->ip_hash = record->ip_is_address ? ip_key_hash(&record->ip_key) : hash_bytes(entry->ip.ptr, entry->ip.len);
+    record->url_hash = hash_bytes(entry->url.ptr, entry->url.len);
+    record->useragent_hash = hash_bytes(entry->useragent.ptr, entry->useragent.len);
+
+    builder->ids[CACHE_COLUMN_IP][row] = dictionary_intern(&dictionaries[CACHE_COLUMN_IP], entry->ip.ptr, entry->ip.len,
+                                                           record->ip_hash,
+                                                           record->ip_is_address ? &record->ip_key : NULL);
+    builder->ids[CACHE_COLUMN_METHOD][row] = dictionary_intern(&dictionaries[CACHE_COLUMN_METHOD], entry->method.ptr,
+                                                               entry->method.len,
+                                                               hash_bytes(entry->method.ptr, entry->method.len), NULL);
+    builder->ids[CACHE_COLUMN_URL][row] = dictionary_intern(&dictionaries[CACHE_COLUMN_URL], entry->url.ptr,
+                                                            entry->url.len, record->url_hash, NULL);
+    builder->ids[CACHE_COLUMN_REFERER][row] = dictionary_intern(&dictionaries[CACHE_COLUMN_REFERER], entry->referer.ptr,
+                                                                entry->referer.len,
+                                                                hash_bytes(entry->referer.ptr, entry->referer.len),
+                                                                NULL);
+    builder->ids[CACHE_COLUMN_USERAGENT][row] = dictionary_intern(&dictionaries[CACHE_COLUMN_USERAGENT],
+                                                                  entry->useragent.ptr, entry->useragent.len,
+                                                                  record->useragent_hash, NULL);
+
+    builder->epochs[row] = record->has_time ? (int64_t)record->time.epoch : 0;
+    builder->utc_offsets[row] = record->has_time ? (int32_t)record->time.utc_offset : LOG_CACHE_NO_TIME;
+    builder->codes[row] = (int32_t)entry->code;
+    builder->sizes[row] = entry->size;
+}
+
+static bool write_padding(FILE* file, uint64_t len) {
+    static const char zeros[8] = {0};
+    size_t pad = (size_t)((8 - len % 8) % 8);
+    return pad == 0 || fwrite(zeros, 1, pad, file) == pad;
+}
+
+static bool write_section(FILE* file, const void* data, size_t len) {
+    return (len == 0 || fwrite(data, 1, len, file) == len) && write_padding(file, len);
+}
+
+static bool seek_spill(FILE* file, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// A run of rows of one worker, in the order the rows are written.
+typedef struct {
+    const CacheRowRun* run;
+    int worker;
+} OrderedRun;
+
+static int compare_ordered_runs(const void* a, const void* b) {
+    uint64_t x = ((const OrderedRun*)a)->run->block_start;
+    uint64_t y = ((const OrderedRun*)b)->run->block_start;
+    return x < y ? -1 : x > y;
+}
+
+// One column, read back from the spill files run by run; string ids are
+// renumbered through the worker's remap.
+static bool write_rows(FILE* file, LogCacheBuilder* builders, const OrderedRun* runs, size_t num_runs, int column,
+                       uint32_t** remaps) {
+    union {
+        uint32_t ids[CACHE_WRITE_CHUNK];
+        int64_t values[CACHE_WRITE_CHUNK];
+    } chunk;
+    size_t width;
+    size_t preceding = 0;
+    for (int c = 0; c < column; c++) {
+        row_column(&builders[0], c, &width);
+        preceding += width;
+    }
+    row_column(&builders[0], column, &width);
+
+    uint64_t len = 0;
+    for (size_t r = 0; r < num_runs; r++) {
+        const CacheRowRun* run = runs[r].run;
+        FILE* spill = builders[runs[r].worker].spill;
+        if (run->num_rows == 0) {
+            continue;
+        }
+        if (!seek_spill(spill, run->file_offset + run->num_rows * preceding)) {
+            return false;
+        }
+        for (size_t row = 0; row < run->num_rows; row += CACHE_WRITE_CHUNK) {
+            size_t n = run->num_rows - row < CACHE_WRITE_CHUNK ? run->num_rows - row : CACHE_WRITE_CHUNK;
+            if (fread(&chunk, width, n, spill) != n) {
+                return false;
+            }
+            if (column < CACHE_STRING_COLUMNS) {
+                const uint32_t* remap = remaps[runs[r].worker * CACHE_STRING_COLUMNS + column];
+                for (size_t i = 0; i < n; i++) {
+                    chunk.ids[i] = remap[chunk.ids[i]];
+                }
+            }
+            if (fwrite(&chunk, width, n, file) != n) {
+                return false;
+            }
+        }
+        len += run->num_rows * width;
+    }
+    return write_padding(file, len);
+}
+
+static bool write_cache_file(FILE* file, const LogCacheHeader* header, CacheDictionaryBuilder* merged,
+                             LogCacheBuilder* builders, const OrderedRun* runs, size_t num_runs, uint32_t** remaps) {
+    if (fwrite(header, sizeof(*header), 1, file) != 1) {
+        return false;
+    }
+
+    for (int c = 0; c < CACHE_STRING_COLUMNS; c++) {
+        if (!write_section(file, merged[c].hashes, merged[c].count * sizeof(uint64_t))
+            || !write_section(file, merged[c].offsets, (merged[c].count + 1) * sizeof(uint64_t))
+            || !write_section(file, merged[c].text, merged[c].text_size)) {
+            return false;
+        }
+    }
+
+    const CacheDictionaryBuilder* ips = &merged[CACHE_COLUMN_IP];
+    if (!write_section(file, ips->ip_keys, ips->count * sizeof(IpKey))
+        || !write_section(file, ips->ip_is_address, ips->count)) {
+        return false;
+    }
+
+    for (int c = 0; c < ROW_COLUMNS; c++) {
+        if (!write_rows(file, builders, runs, num_runs, c, remaps)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A time range is only searched for in caches whose rows are known to be in
+// time order within the slack. Every row of a run is already checked
+// against the earlier rows of its run, so across runs only the earliest
+// time of each needs checking against the latest before it.
+static bool runs_are_time_ordered(const OrderedRun* runs, size_t num_runs) {
+    bool seen = false;
+    int64_t latest = 0;
+    for (size_t r = 0; r < num_runs; r++) {
+        const CacheRowRun* run = runs[r].run;
+        if (!run->has_time) {
+            continue;
+        }
+        if (!run->time_ordered || (seen && run->min_time < latest - TIME_SEEK_SLACK)) {
+            return false;
+        }
+        latest = !seen || run->max_time > latest ? run->max_time : latest;
+        seen = true;
+    }
+    return true;
+}
+
+// Merges the workers' dictionaries into shared ones and writes the rows of
+// all builders, in the order of the blocks they came from, to filename. The file is written under a
+// temporary name first, so a reader never sees a partial cache.
+bool write_log_cache(const char* filename, const LogCacheSource* source, LogCacheBuilder* builders, int count) {
+    for (int w = 0; w < count; w++) {
+        flush_builder_run(&builders[w]);
+        if (builders[w].failed) {
+            return false;
+        }
+    }
+
+    CacheDictionaryBuilder merged[CACHE_STRING_COLUMNS];
+    uint32_t** remaps = (uint32_t**)malloc((size_t)count * CACHE_STRING_COLUMNS * sizeof(uint32_t*));
+
+    LogCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = LOG_CACHE_VERSION;
+    header.byte_order = LOG_CACHE_BYTE_ORDER;
+    header.source = *source;
+
+    for (int c = 0; c < CACHE_STRING_COLUMNS; c++) {
+        init_dictionary_builder(&merged[c], c == CACHE_COLUMN_IP);
+        for (int w = 0; w < count; w++) {
+            const CacheDictionaryBuilder* local = &builders[w].dictionaries[c];
+            uint32_t* remap = (uint32_t*)malloc((local->count > 0 ? local->count : 1) * sizeof(uint32_t));
+            for (size_t id = 0; id < local->count; id++) {
+                const IpKey* ip_key = local->ip_keys != NULL && local->ip_is_address[id] ? &local->ip_keys[id] : NULL;
+                remap[id] = dictionary_intern(&merged[c], local->text + local->offsets[id],
+                                              (size_t)(local->offsets[id + 1] - local->offsets[id]),
+                                              local->hashes[id], ip_key);
+            }
+            remaps[w * CACHE_STRING_COLUMNS + c] = remap;
+        }
+        header.dictionary_counts[c] = merged[c].count;
+        header.dictionary_text_sizes[c] = merged[c].text_size;
+    }
+    size_t num_runs = 0;
+    for (int w = 0; w < count; w++) {
+        num_runs += builders[w].num_runs;
+    }
+    OrderedRun* runs = (OrderedRun*)malloc((num_runs > 0 ? num_runs : 1) * sizeof(OrderedRun));
+    num_runs = 0;
+    for (int w = 0; w < count; w++) {
+        for (size_t r = 0; r < builders[w].num_runs; r++) {
+            runs[num_runs].run = &builders[w].runs[r];
+            runs[num_runs].worker = w;
+            header.num_rows += builders[w].runs[r].num_rows;
+            num_runs++;
+        }
+    }
+    qsort(runs, num_runs, sizeof(OrderedRun), compare_ordered_runs);
+    header.time_ordered = runs_are_time_ordered(runs, num_runs);
+
+    size_t name_len = strlen(filename);
+    char* temp_filename = (char*)malloc(name_len + 5);
+    memcpy(temp_filename, filename, name_len);
+    memcpy(temp_filename + name_len, ".tmp", 5);
+
+    bool ok = false;
+    FILE* file = fopen(temp_filename, "wb");
+    if (file != NULL) {
+        ok = write_cache_file(file, &header, merged, builders, runs, num_runs, remaps);
+        ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+        // rename does not replace an existing file here.
+        if (ok) {
+            remove(filename);
+        }
+#endif
+        ok = ok && rename(temp_filename, filename) == 0;
+        if (!ok) {
+            remove(temp_filename);
+        }
+    }
+
+    free(temp_filename);
+    for (int c = 0; c < CACHE_STRING_COLUMNS; c++) {
+        free_dictionary_builder(&merged[c]);
+        for (int w = 0; w < count; w++) {
+            free(remaps[w * CACHE_STRING_COLUMNS + c]);
+        }
+    }
+    free(remaps);
+    free(runs);
+    return ok;
+}
+
+// Walks the sections of a mapped cache in file order.
+typedef struct {
+    const char* base;
+    uint64_t size;
+    uint64_t pos;
+    bool ok;
+} CacheCursor;
+
+// Returns the next section of count elements and steps over its padding;
+// NULL, and the cursor marked failed, if it would run past the file.
+static const void* take_section(CacheCursor* cursor, uint64_t count, uint64_t width) {
+    uint64_t remaining = cursor->size - cursor->pos;
+    if (!cursor->ok || count > remaining / width) {
+        cursor->ok = false;
+        return NULL;
+    }
+
+    uint64_t len = count * width;
+    len += (8 - len % 8) % 8;
+    if (len > remaining) {
+        cursor->ok = false;
+        return NULL;
+    }
+
+    const void* section = cursor->base + cursor->pos;
+    cursor->pos += len;
+    return section;
+}
+
+static bool dictionary_is_valid(const CacheDictionary* dictionary, uint64_t text_size) {
+    if (dictionary->offsets[0] != 0 || dictionary->offsets[dictionary->count] != text_size) {
+        return false;
+    }
+    for (uint64_t i = 0; i < dictionary->count; i++) {
+        if (dictionary->offsets[i + 1] < dictionary->offsets[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool ids_are_valid(const uint32_t* ids, uint64_t num_rows, uint64_t count) {
+    uint32_t max_id = 0;
+    for (uint64_t row = 0; row < num_rows; row++) {
+        max_id = ids[row] > max_id ? ids[row] : max_id;
+    }
+    return num_rows == 0 || max_id < count;
+}
+
+// Locates every section of the mapped file and checks that it is a
+// complete cache of this version for source. Ids and offsets are checked
+// here once so that reading rows needs no bounds checks.
+static bool load_cache_layout(LogCache* cache, const LogCacheSource* source) {
+    if (cache->map.size < sizeof(LogCacheHeader)) {
+        return false;
+    }
+
+    LogCacheHeader header;
+    memcpy(&header, cache->map.data, sizeof(header));
+    if (memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 || header.version != LOG_CACHE_VERSION
+        || header.byte_order != LOG_CACHE_BYTE_ORDER || header.source.size != source->size
+        || header.source.mtime != source->mtime || header.source.format_hash != source->format_hash) {
+        return false;
+    }
+
+    CacheCursor cursor;
+    cursor.base = cache->map.data;
+    cursor.size = cache->map.size;
+    cursor.pos = sizeof(LogCacheHeader);
+    cursor.ok = true;
+
+    for (int c = 0; c < CACHE_STRING_COLUMNS; c++) {
+        CacheDictionary* dictionary = &cache->dictionaries[c];
+        dictionary->count = header.dictionary_counts[c];
+        if (dictionary->count > UINT32_MAX) {
+            return false;
+        }
+        dictionary->hashes = (const uint64_t*)take_section(&cursor, dictionary->count, sizeof(uint64_t));
+        dictionary->offsets = (const uint64_t*)take_section(&cursor, dictionary->count + 1, sizeof(uint64_t));
+        dictionary->text = (const char*)take_section(&cursor, header.dictionary_text_sizes[c], 1);
+        if (!cursor.ok || !dictionary_is_valid(dictionary, header.dictionary_text_sizes[c])) {
+            return false;
+        }
+    }
+
+    uint64_t num_ips = header.dictionary_counts[CACHE_COLUMN_IP];
+    cache->ip_keys = (const IpKey*)take_section(&cursor, num_ips, sizeof(IpKey));
+    cache->ip_is_address = (const uint8_t*)take_section(&cursor, num_ips, 1);
+
+    cache->num_rows = header.num_rows;
+    cache->time_ordered = header.time_ordered != 0;
+    for (int c = 0; c < CACHE_STRING_COLUMNS; c++) {
+        cache->ids[c] = (const uint32_t*)take_section(&cursor, cache->num_rows, sizeof(uint32_t));
+    }
+    cache->epochs = (const int64_t*)take_section(&cursor, cache->num_rows, sizeof(int64_t));
+    cache->utc_offsets = (const int32_t*)take_section(&cursor, cache->num_rows, sizeof(int32_t));
+    cache->codes = (const int32_t*)take_section(&cursor, cache->num_rows, sizeof(int32_t));
+    cache->sizes = (const int64_t*)take_section(&cursor, cache->num_rows, sizeof(int64_t));
+    if (!cursor.ok || cursor.pos != cursor.size) {
+        return false;
+    }
+
+    for (int c = 0; c < CACHE_STRING_COLUMNS; c++) {
+        if (!ids_are_valid(cache->ids[c], cache->num_rows, cache->dictionaries[c].count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Maps filename and returns true if it is a usable cache for source; a
+// missing, stale or damaged cache returns false and should be rebuilt.
+bool open_log_cache(LogCache* cache, const char* filename, const LogCacheSource* source) {
+    memset(cache, 0, sizeof(*cache));
+    if (!map_file(filename, &cache->map)) {
+        return false;
+    }
+    if (!load_cache_layout(cache, source)) {
+        unmap_file(&cache->map);
+        return false;
+    }
+    return true;
+}
+
+void close_log_cache(LogCache* cache) {
+    unmap_file(&cache->map);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static StrSpan dictionary_entry(const CacheDictionary* dictionary, uint32_t id) {
+    return make_span(dictionary->text + dictionary->offsets[id],
+                     (size_t)(dictionary->offsets[id + 1] - dictionary->offsets[id]));
+}
+
+// Rebuilds row as a record with its hashes filled in. The datetime span is
+// left empty; the decoded time is in record->time.
+void log_cache_read_record(const LogCache* cache, size_t row, LogRecord* record) {
+    uint32_t ip_id = cache->ids[CACHE_COLUMN_IP][row];
+    uint32_t url_id = cache->ids[CACHE_COLUMN_URL][row];
+    uint32_t useragent_id = cache->ids[CACHE_COLUMN_USERAGENT][row];
+
+    record->entry.ip = dictionary_entry(&cache->dictionaries[CACHE_COLUMN_IP], ip_id);
+    record->entry.datetime = make_span("", 0);
+    record->entry.method = dictionary_entry(&cache->dictionaries[CACHE_COLUMN_METHOD],
+                                            cache->ids[CACHE_COLUMN_METHOD][row]);
+    record->entry.url = dictionary_entry(&cache->dictionaries[CACHE_COLUMN_URL], url_id);
+    record->entry.code = cache->codes[row];
+    record->entry.size = cache->sizes[row];
+    record->entry.referer = dictionary_entry(&cache->dictionaries[CACHE_COLUMN_REFERER],
+                                             cache->ids[CACHE_COLUMN_REFERER][row]);
+    record->entry.useragent = dictionary_entry(&cache->dictionaries[CACHE_COLUMN_USERAGENT], useragent_id);
+
+    record->ip_is_address = cache->ip_is_address[ip_id] != 0;
+    record->ip_key = cache->ip_keys[ip_id];
+    record->has_time = cache->utc_offsets[row] != LOG_CACHE_NO_TIME;
+    record->time.epoch = (time_t)cache->epochs[row];
+    record->time.utc_offset = record->has_time ? cache->utc_offsets[row] : 0;
+
+    record->ip_hash = cache->dictionaries[CACHE_COLUMN_IP].hashes[ip_id];
+    record->url_hash = cache->dictionaries[CACHE_COLUMN_URL].hashes[url_id];
+    record->useragent_hash = cache->dictionaries[CACHE_COLUMN_USERAGENT].hashes[useragent_id];
+}
+
+static bool probe_cache_time(void* context, size_t position, size_t limit, size_t* next, int64_t* time) {
+    const LogCache* cache = (const LogCache*)context;
+    for (size_t row = position; row < limit; row++) {
+        if (cache->utc_offsets[row] != LOG_CACHE_NO_TIME) {
+            *next = row + 1;
+            *time = cache->epochs[row];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Rows are in log order, so a -start/-end query is narrowed the same way
+// as on the log itself; see find_log_time_range. Only done when the writer
+// found every row in order, as sampling can miss a short run out of place.
+bool log_cache_find_time_range(const LogCache* cache, time_t start_time, time_t end_time, size_t* start_row,
+                               size_t* end_row) {
+    if (!cache->time_ordered) {
+        *start_row = 0;
+        *end_row = (size_t)cache->num_rows;
+        return false;
+    }
+    return seek_time_range(probe_cache_time, (void*)cache, (size_t)cache->num_rows, (int64_t)start_time,
+                           (int64_t)end_time, start_row, end_row);
+}
+
+// Restricts the cache to rows [start_row, end_row); the mapping is kept
+// whole and is still released by close_log_cache.
+void log_cache_select_rows(LogCache* cache, size_t start_row, size_t end_row) {
+    for (int c = 0; c < CACHE_STRING_COLUMNS; c++) {
+        cache->ids[c] += start_row;
+    }
+    cache->epochs += start_row;
+    cache->utc_offsets += start_row;
+    cache->codes += start_row;
+    cache->sizes += start_row;
+    cache->num_rows = end_row - start_row;
+}
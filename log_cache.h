@@ -0,0 +1,120 @@
+#ifndef LOG_CACHE_H
+#define LOG_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "log_analyzer.h"
+#include "file_map.h"
+
+#define LOG_CACHE_SUFFIX ".hpcache"
+// Rows per scheduler block when aggregating from a cache.
+#define LOG_CACHE_BLOCK_ROWS (64 * 1024)
+
+// String columns of the cache. Every distinct value is stored once in a
+// dictionary and rows refer to it by a 32-bit id.
+typedef enum {
+    CACHE_COLUMN_IP,
+    CACHE_COLUMN_METHOD,
+    CACHE_COLUMN_URL,
+    CACHE_COLUMN_REFERER,
+    CACHE_COLUMN_USERAGENT,
+    CACHE_STRING_COLUMNS
+} CacheStringColumn;
+
+// What a cache was built from. A cache is only used while the log still has
+// the same size and modification time and is read with the same format.
+typedef struct {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t format_hash;
+} LogCacheSource;
+
+// Dictionary inside a mapped cache: entry i is text[offsets[i], offsets[i + 1])
+// and hashes[i] is the hash the aggregation uses for it.
+typedef struct {
+    uint64_t count;
+    const uint64_t* hashes;
+    const uint64_t* offsets;
+    const char* text;
+} CacheDictionary;
+
+// A cache file mapped for reading. All arrays point into the mapping.
+typedef struct LogCache {
+    FileMap map;
+    uint64_t num_rows;
+    CacheDictionary dictionaries[CACHE_STRING_COLUMNS];
+    // Parsed address of each IP dictionary entry, where it is one.
+    const IpKey* ip_keys;
+    const uint8_t* ip_is_address;
+    const uint32_t* ids[CACHE_STRING_COLUMNS];
+    const int64_t* epochs;
+    // LOG_CACHE_NO_TIME for rows whose timestamp could not be parsed.
+    const int32_t* utc_offsets;
+    const int32_t* codes;
+    const int64_t* sizes;
+    // Set when the writer checked that the rows are in time order, so
+    // log_cache_find_time_range may search them.
+    bool time_ordered;
+} LogCache;
+
+#define LOG_CACHE_NO_TIME INT32_MIN
+
+typedef struct CacheDictionaryBuilder CacheDictionaryBuilder;
+
+// Rows a worker collected from one scheduler block; block_start is the
+// block's offset in the log and file_offset where the run starts in the
+// worker's spill file. The time summary lets the writer check the order of
+// all rows without reading them back.
+typedef struct {
+    uint64_t block_start;
+    uint64_t file_offset;
+    size_t num_rows;
+    bool has_time;
+    bool time_ordered;
+    int64_t min_time;
+    int64_t max_time;
+} CacheRowRun;
+
+// Rows collected by one worker while it parses the log, with ids into its
+// own dictionaries; write_log_cache renumbers them into shared ones. Only
+// the rows of the current block are kept in memory: when the worker moves
+// to the next block they are appended, column by column, to the worker's
+// spill file. With work stealing a worker's blocks are not contiguous, so
+// the runs are written to the cache in block order.
+typedef struct LogCacheBuilder {
+    CacheDictionaryBuilder* dictionaries;
+    uint32_t* ids[CACHE_STRING_COLUMNS];
+    int64_t* epochs;
+    int32_t* utc_offsets;
+    int32_t* codes;
+    int64_t* sizes;
+    size_t num_rows;
+    size_t capacity;
+    CacheRowRun* runs;
+    size_t num_runs;
+    size_t runs_capacity;
+    char* spill_filename;
+    FILE* spill;
+    uint64_t spill_size;
+    // Set once a spill write fails; the cache is then not written.
+    bool failed;
+} LogCacheBuilder;
+
+bool get_log_cache_source(const char* log_filename, const LogFormat* format, LogCacheSource* source);
+bool open_log_cache(LogCache* cache, const char* filename, const LogCacheSource* source);
+void close_log_cache(LogCache* cache);
+void log_cache_read_record(const LogCache* cache, size_t row, LogRecord* record);
+bool log_cache_find_time_range(const LogCache* cache, time_t start_time, time_t end_time, size_t* start_row,
+                               size_t* end_row);
+void log_cache_select_rows(LogCache* cache, size_t start_row, size_t end_row);
+
+void init_log_cache_builder(LogCacheBuilder* builder, const char* cache_filename, int worker);
+void free_log_cache_builder(LogCacheBuilder* builder);
+void log_cache_builder_begin_block(LogCacheBuilder* builder, uint64_t block_start);
+void log_cache_builder_add(LogCacheBuilder* builder, LogRecord* record);
+bool write_log_cache(const char* filename, const LogCacheSource* source, LogCacheBuilder* builders, int count);
+
+#endif
@@ -12,6 +12,12 @@
 
 #include "log_analyzer.h"
 #include "config.h"
+#include "file_map.h"
+#include "scanner.h"
+#include "cpu_topology.h"
+#include "log_cache.h"
+#include "block_filter.h"
+#include "filter_expr.h"
 
 char* strptime(const char* s, const char* format, struct tm* tm) {
     if (strcmp(format, "%Y-%m-%d %H:%M:%S") == 0) {
@@ -34,6 +40,102 @@ char* strptime(const char* s, const char* format, struct tm* tm) {
     return NULL;
 }
 
+// Appends one rollup per entry of a list such as "/24,/16" or "48".
+static bool parse_prefix_list(const char* text, bool v4, NetRollup** rollups, int* num_rollups) {
+    int max_len = v4 ? 32 : 128;
+    const char* p = text;
+
+    while (*p != '\0') {
+        if (*p == '/') {
+            p++;
+        }
+        char* end;
+        long prefix_len = strtol(p, &end, 10);
+        if (end == p || prefix_len < 0 || prefix_len > max_len || (*end != ',' && *end != '\0')) {
+            return false;
+        }
+
+        *rollups = (NetRollup*)realloc(*rollups, (*num_rollups + 1) * sizeof(NetRollup));
+        (*rollups)[*num_rollups].v4 = v4;
+        (*rollups)[*num_rollups].prefix_len = (int)prefix_len;
+        (*num_rollups)++;
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return true;
+}
+
+// Accepts a count followed by s, m, h or d, e.g. "10s" or "1h".
+static bool parse_bucket_width(const char* text, int* width) {
+    char* end;
+    long count = strtol(text, &end, 10);
+    if (end == text || count <= 0 || end[0] == '\0' || end[1] != '\0') {
+        return false;
+    }
+
+    long unit;
+    switch (end[0]) {
+        case 's': unit = 1; break;
+        case 'm': unit = 60; break;
+        case 'h': unit = 3600; break;
+        case 'd': unit = 86400; break;
+        default: return false;
+    }
+
+    if (count > 365L * 86400 / unit) {
+        return false;
+    }
+    *width = (int)(count * unit);
+    return true;
+}
+
+// Parses a comma-separated field list such as "ip,code" into options.
+static bool parse_group_fields(const char* text, AnalyzerOptions* options) {
+    const char* p = text;
+
+    options->num_group_fields = 0;
+    while (*p != '\0') {
+        const char* end = strchr(p, ',');
+        size_t len = end != NULL ? (size_t)(end - p) : strlen(p);
+
+        int found = -1;
+        for (int field = GROUP_FIELD_IP; field <= GROUP_FIELD_REFERER; field++) {
+            const char* name = group_field_name((GroupField)field);
+            if (strlen(name) == len && strncmp(name, p, len) == 0) {
+                found = field;
+                break;
+            }
+        }
+        if (found < 0 || options->num_group_fields == MAX_GROUP_FIELDS) {
+            return false;
+        }
+        options->group_fields[options->num_group_fields++] = (GroupField)found;
+
+        p = end != NULL ? end + 1 : p + len;
+    }
+
+    return options->num_group_fields > 0;
+}
+
+// Picks the text that every line matching the -ip and -url filters must
+// contain, preferring the longer one. An -ip value that is an address is
+// matched by IpKey, so it also matches other spellings such as
+// ::ffff:a00:9 for 10.0.0.9 that do not contain its text; only the -url
+// text is used then.
+static const char* choose_prefilter(const char* ip_filter, const char* url_filter) {
+    const char* ip_text = NULL;
+    IpKey key;
+    if (ip_filter != NULL && !parse_ip_key(ip_filter, strlen(ip_filter), &key)) {
+        ip_text = ip_filter;
+    }
+
+    if (url_filter == NULL || (ip_text != NULL && strlen(ip_text) > strlen(url_filter))) {
+        return ip_text;
+    }
+    return url_filter;
+}
+
 LogFormat** g_formats;
 int* g_num_formats;
 
@@ -53,6 +155,23 @@ int main(int argc, char** argv) {
     time_t end_time = 0;
     bool time_stats_enabled = false;
     char* config_file = NULL;
+    int num_threads = 0;
+    bool pin_threads = false;
+    NetRollup* net_rollups = NULL;
+    int num_net_rollups = 0;
+    int top_net = 10;
+    int top_group = 10;
+    bool normalize_urls = false;
+    bool query_mode_set = false;
+    QueryMode query_mode = QUERY_KEEP;
+    char* routes_file = NULL;
+    char* ip_set_file = NULL;
+    char* ip_exclude_set_file = NULL;
+    char* where_text = NULL;
+    bool use_cache = false;
+    bool use_block_filter = false;
+    AnalyzerOptions options;
+    memset(&options, 0, sizeof(options));
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
@@ -65,15 +184,70 @@ int main(int argc, char** argv) {
             top_url = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-topua") == 0 && i + 1 < argc) {
             top_useragent = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-topnet") == 0 || strcmp(argv[i], "-topnet6") == 0) && i + 1 < argc) {
+            bool v4 = strcmp(argv[i], "-topnet") == 0;
+            if (!parse_prefix_list(argv[++i], v4, &net_rollups, &num_net_rollups)) {
+                fprintf(stderr, "Error: Invalid prefix length list '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-topnetn") == 0 && i + 1 < argc) {
+            top_net = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-approx") == 0 && i + 1 < argc) {
+            options.approx_counters = atoi(argv[++i]);
+            if (options.approx_counters < 1) {
+                fprintf(stderr, "Error: Invalid counter count '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-normurl") == 0) {
+            normalize_urls = true;
+        } else if (strcmp(argv[i], "-query") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "keep") == 0) {
+                query_mode = QUERY_KEEP;
+            } else if (strcmp(argv[i], "strip") == 0) {
+                query_mode = QUERY_STRIP;
+            } else if (strcmp(argv[i], "sort") == 0) {
+                query_mode = QUERY_SORT;
+            } else {
+                fprintf(stderr, "Error: Invalid query mode '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            query_mode_set = true;
+        } else if (strcmp(argv[i], "-routes") == 0 && i + 1 < argc) {
+            routes_file = argv[++i];
         } else if (strcmp(argv[i], "-ip") == 0 && i + 1 < argc) {
             ip_filter = argv[++i];
         } else if (strcmp(argv[i], "-url") == 0 && i + 1 < argc) {
             url_filter = argv[++i];
+        } else if (strcmp(argv[i], "-ipset") == 0 && i + 1 < argc) {
+            ip_set_file = argv[++i];
+        } else if (strcmp(argv[i], "-notipset") == 0 && i + 1 < argc) {
+            ip_exclude_set_file = argv[++i];
+        } else if (strcmp(argv[i], "-where") == 0 && i + 1 < argc) {
+            where_text = argv[++i];
         } else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc) {
             if (strcmp(argv[i + 1], "stats") == 0) {
                 time_stats_enabled = true;
                 i++;
             }
+        } else if (strcmp(argv[i], "-unique") == 0) {
+            options.distinct_counts = true;
+        } else if (strcmp(argv[i], "-bytes") == 0) {
+            options.rank_by_bytes = true;
+        } else if (strcmp(argv[i], "-sizes") == 0) {
+            options.size_quantiles = true;
+        } else if (strcmp(argv[i], "-groupby") == 0 && i + 1 < argc) {
+            if (!parse_group_fields(argv[++i], &options)) {
+                fprintf(stderr, "Error: Invalid field list '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-topgroup") == 0 && i + 1 < argc) {
+            top_group = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-bucket") == 0 && i + 1 < argc) {
+            if (!parse_bucket_width(argv[++i], &options.bucket_width)) {
+                fprintf(stderr, "Error: Invalid bucket width '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
         } else if (strcmp(argv[i], "-start") == 0 && i + 1 < argc) {
             struct tm tm_info = {0};
             strptime(argv[++i], "%Y-%m-%d %H:%M:%S", &tm_info);
@@ -82,6 +256,18 @@ int main(int argc, char** argv) {
             struct tm tm_info = {0};
             strptime(argv[++i], "%Y-%m-%d %H:%M:%S", &tm_info);
             end_time = mktime(&tm_info);
+        } else if (strcmp(argv[i], "-cache") == 0) {
+            use_cache = true;
+        } else if (strcmp(argv[i], "-bloom") == 0) {
+            use_block_filter = true;
+        } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+            if (num_threads < 1) {
+                fprintf(stderr, "Error: Invalid thread count '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-pin") == 0) {
+            pin_threads = true;
         } else if (strcmp(argv[i], "-config") == 0 && i + 1 < argc) {
             config_file = argv[++i];
         } else if (strcmp(argv[i], "-h") == 0) {
@@ -96,6 +282,39 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
+    if (options.approx_counters > 0 && num_net_rollups > 0) {
+        fprintf(stderr, "Error: -topnet and -topnet6 need exact IP counts and cannot be used with -approx\n");
+        return EXIT_FAILURE;
+    }
+
+    if (normalize_urls && !query_mode_set) {
+        query_mode = QUERY_STRIP;
+    }
+    UrlNormalizer url_normalizer;
+    init_url_normalizer(&url_normalizer, query_mode, normalize_urls);
+    if (routes_file != NULL && !load_url_routes(&url_normalizer, routes_file)) {
+        fprintf(stderr, "Error: Cannot load routes from '%s'\n", routes_file);
+        return EXIT_FAILURE;
+    }
+
+    IpSet ip_set;
+    IpSet ip_exclude_set;
+    init_ip_set(&ip_set);
+    init_ip_set(&ip_exclude_set);
+    if (ip_set_file != NULL && !load_ip_set(&ip_set, ip_set_file)) {
+        fprintf(stderr, "Error: Cannot load IP set from '%s'\n", ip_set_file);
+        return EXIT_FAILURE;
+    }
+    if (ip_exclude_set_file != NULL && !load_ip_set(&ip_exclude_set, ip_exclude_set_file)) {
+        fprintf(stderr, "Error: Cannot load IP set from '%s'\n", ip_exclude_set_file);
+        return EXIT_FAILURE;
+    }
+
+    FilterExpr where;
+    if (where_text != NULL && !compile_filter_expr(&where, where_text)) {
+        return EXIT_FAILURE;
+    }
+
     LogFormat* formats = NULL;
     int num_formats = 0;
     init_log_formats(&formats, &num_formats);
@@ -120,36 +339,137 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
+    init_scanner();
+
+    // A valid sidecar cache takes the place of the log; otherwise the log
+    // is parsed and the cache written from what the workers collected.
+    LogCacheSource cache_source;
+    LogCache cache;
+    bool cache_loaded = false;
+    char* cache_filename = NULL;
+    if ((use_cache || use_block_filter) && !get_log_cache_source(filename, selected_format, &cache_source)) {
+        fprintf(stderr, "Warning: '%s' is not a regular file, -cache and -bloom are ignored\n", filename);
+        use_cache = false;
+        use_block_filter = false;
+    }
+    if (use_cache) {
+        cache_filename = (char*)malloc(strlen(filename) + strlen(LOG_CACHE_SUFFIX) + 1);
+        strcpy(cache_filename, filename);
+        strcat(cache_filename, LOG_CACHE_SUFFIX);
+        cache_loaded = open_log_cache(&cache, cache_filename, &cache_source);
+    }
+
+    FileMap log_map;
+    memset(&log_map, 0, sizeof(log_map));
+    if (!cache_loaded && !map_file(filename, &log_map)) {
         fprintf(stderr, "Error: Cannot open file '%s': %s\n", filename, strerror(errno));
         return EXIT_FAILURE;
     }
 
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    size_t file_size = log_map.size;
+
+    // Block filters answer for the log, so they are not needed when the
+    // cache is read instead.
+    BlockFilterIndex block_filter;
+    bool block_filter_loaded = false;
+    bool build_block_filter = false;
+    char* block_filter_filename = NULL;
+    if (use_block_filter && !cache_loaded) {
+        block_filter_filename = (char*)malloc(strlen(filename) + strlen(BLOCK_FILTER_SUFFIX) + 1);
+        strcpy(block_filter_filename, filename);
+        strcat(block_filter_filename, BLOCK_FILTER_SUFFIX);
+        block_filter_loaded = open_block_filter_index(&block_filter, block_filter_filename, &cache_source,
+                                                      DEFAULT_BLOCK_SIZE);
+        if (!block_filter_loaded) {
+            init_block_filter_index(&block_filter, file_size, DEFAULT_BLOCK_SIZE);
+            build_block_filter = true;
+        }
+    }
+
+    // A time window on a time-ordered input is found by binary search, and
+    // only that part is handed to the workers. A cache being built needs
+    // every line, so the first -cache or -bloom run still reads the whole log.
+    const char* log_data = log_map.data;
+    size_t data_offset = 0;
+    bool build_cache = use_cache && !cache_loaded;
+    if ((start_time > 0 || end_time > 0) && !build_cache && !build_block_filter) {
+        size_t range_start, range_end;
+        if (cache_loaded) {
+            if (log_cache_find_time_range(&cache, start_time, end_time, &range_start, &range_end)) {
+                log_cache_select_rows(&cache, range_start, range_end);
+            }
+        } else if (find_log_time_range(log_map.data, log_map.size, selected_format, start_time, end_time,
+                                       &range_start, &range_end)) {
+            log_data = log_map.data + range_start;
+            data_offset = range_start;
+            file_size = range_end - range_start;
+        }
+    }
+
+    if (num_threads == 0) {
+        num_threads = detect_cpu_count();
+    }
 
-    AnalyzerStats stats;
-    init_analyzer_stats(&stats);
+    int* cpus = (int*)malloc(num_threads * sizeof(int));
+    int num_cpus = get_allowed_cpus(cpus, num_threads);
 
-    int num_threads = 4;
+    BlockScheduler scheduler;
+    if (cache_loaded) {
+        init_block_scheduler(&scheduler, (size_t)cache.num_rows, LOG_CACHE_BLOCK_ROWS, num_threads);
+    } else {
+        init_block_scheduler(&scheduler, file_size, DEFAULT_BLOCK_SIZE, num_threads);
+    }
+
+    // Lines are skipped unparsed only when nothing has to see every line.
+    const char* prefilter = NULL;
+    if (!cache_loaded && !build_cache && !build_block_filter) {
+        prefilter = choose_prefilter(ip_filter, url_filter);
+    }
+
+    LogCacheBuilder* cache_builders = NULL;
+    if (build_cache) {
+        cache_builders = (LogCacheBuilder*)malloc(num_threads * sizeof(LogCacheBuilder));
+        for (int i = 0; i < num_threads; i++) {
+            init_log_cache_builder(&cache_builders[i], cache_filename, i);
+        }
+    }
 
-    long chunk_size = file_size / num_threads;
-    
     pthread_t* threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
     ThreadData* thread_data = (ThreadData*)malloc(num_threads * sizeof(ThreadData));
+    AnalyzerStats* thread_stats = (AnalyzerStats*)malloc(num_threads * sizeof(AnalyzerStats));
 
     for (int i = 0; i < num_threads; i++) {
-        thread_data[i].file = file;
-        thread_data[i].start_offset = i * chunk_size;
-        thread_data[i].end_offset = (i == num_threads - 1) ? file_size : (i + 1) * chunk_size;
+        thread_data[i].data = log_data;
+        thread_data[i].data_size = file_size;
+        thread_data[i].scheduler = &scheduler;
+        thread_data[i].worker_index = i;
+
+        if (!cache_loaded) {
+            size_t start_offset, end_offset;
+            scheduler_initial_range(&scheduler, i, &start_offset, &end_offset);
+            advise_file_range(&log_map, data_offset + start_offset, data_offset + end_offset);
+        }
+
         thread_data[i].format = selected_format;
-        thread_data[i].stats = &stats;
+        thread_data[i].stats = &thread_stats[i];
         thread_data[i].ip_filter = ip_filter;
         thread_data[i].url_filter = url_filter;
         thread_data[i].start_time_filter = start_time;
         thread_data[i].end_time_filter = end_time;
+        thread_data[i].cpu = pin_threads ? cpus[i % num_cpus] : -1;
+        thread_data[i].options = &options;
+        thread_data[i].url_normalizer = url_normalizer_is_active(&url_normalizer) ? &url_normalizer : NULL;
+        thread_data[i].cache = cache_loaded ? &cache : NULL;
+        thread_data[i].cache_builder = cache_builders != NULL ? &cache_builders[i] : NULL;
+        thread_data[i].data_offset = data_offset;
+        // A cache being built needs every line, so no block is skipped then.
+        thread_data[i].block_filter = block_filter_loaded && !build_cache && (ip_filter != NULL || url_filter != NULL)
+            ? &block_filter : NULL;
+        thread_data[i].block_filter_builder = build_block_filter ? &block_filter : NULL;
+        thread_data[i].prefilter = prefilter;
+        thread_data[i].ip_set = ip_set_file != NULL ? &ip_set : NULL;
+        thread_data[i].ip_exclude_set = ip_exclude_set_file != NULL ? &ip_exclude_set : NULL;
+        thread_data[i].where = where_text != NULL ? &where : NULL;
 
         if (pthread_create(&threads[i], NULL, process_log_chunk, &thread_data[i]) != 0) {
             fprintf(stderr, "Error: Failed to create thread %d\n", i);
@@ -161,40 +481,122 @@ int main(int argc, char** argv) {
         pthread_join(threads[i], NULL);
     }
 
-    printf("\n===== Analysis Results =====\n\n");
+    free_block_scheduler(&scheduler);
 
-    if (top_ip > 0) {
-        print_top_n(stats.ip_stats.ips, stats.ip_stats.counts, stats.ip_stats.size, top_ip, "Top IP Addresses");
+    if (cache_builders != NULL) {
+        if (!write_log_cache(cache_filename, &cache_source, cache_builders, num_threads)) {
+            fprintf(stderr, "Warning: Cannot write cache '%s'\n", cache_filename);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            free_log_cache_builder(&cache_builders[i]);
+        }
+        free(cache_builders);
     }
 
-    if (top_url > 0) {
-        print_top_n(stats.url_stats.urls, stats.url_stats.counts, stats.url_stats.size, top_url, "Top URLs");
+    if (build_block_filter && !write_block_filter_index(&block_filter, block_filter_filename, &cache_source)) {
+        fprintf(stderr, "Warning: Cannot write block filters '%s'\n", block_filter_filename);
     }
 
-    if (top_useragent > 0) {
-        print_top_n(stats.useragent_stats.useragents, stats.useragent_stats.counts, stats.useragent_stats.size, top_useragent, "Top User Agents");
+    merge_analyzer_stats_parallel(thread_stats, num_threads);
+    AnalyzerStats* stats = &thread_stats[0];
+
+    for (int i = 0; i < num_net_rollups; i++) {
+        init_ip_table(&net_rollups[i].table);
     }
+    ip_table_rollup(&stats->ip_stats, net_rollups, num_net_rollups, num_threads);
 
-    print_response_code_stats(stats.response_codes, "HTTP Response Codes");
+    printf("\n===== Analysis Results =====\n\n");
+
+    bool by_bytes = options.rank_by_bytes;
+    if (options.approx_counters > 0) {
+        if (top_ip > 0) {
+            print_top_approx(&stats->ip_approx, top_ip, by_bytes ? "Top IP Addresses by Bytes" : "Top IP Addresses",
+                             true, by_bytes);
+        }
+
+        if (top_url > 0) {
+            print_top_approx(&stats->url_approx, top_url, by_bytes ? "Top URLs by Bytes" : "Top URLs", false, by_bytes);
+        }
+
+        if (top_useragent > 0) {
+            print_top_approx(&stats->useragent_approx, top_useragent,
+                             by_bytes ? "Top User Agents by Bytes" : "Top User Agents", false, by_bytes);
+        }
+    } else {
+        if (top_ip > 0) {
+            print_top_ips(stats, top_ip, by_bytes ? "Top IP Addresses by Bytes" : "Top IP Addresses", num_threads);
+        }
+
+        for (int i = 0; i < num_net_rollups; i++) {
+            print_top_nets(&net_rollups[i], top_net, by_bytes, num_threads);
+        }
+
+        if (top_url > 0) {
+            print_top_n(&stats->url_stats, top_url, by_bytes ? "Top URLs by Bytes" : "Top URLs", by_bytes, num_threads);
+        }
+
+        if (top_useragent > 0) {
+            print_top_n(&stats->useragent_stats, top_useragent,
+                        by_bytes ? "Top User Agents by Bytes" : "Top User Agents", by_bytes, num_threads);
+        }
+    }
+
+    if (options.num_group_fields > 0) {
+        print_group_stats(stats, top_group, num_threads);
+    }
+
+    print_response_code_stats(stats->response_codes, by_bytes ? stats->response_bytes : NULL, "HTTP Response Codes");
 
     if (time_stats_enabled) {
         printf("\n----- Time-based Statistics -----\n");
         printf("Requests per hour:\n");
         for (int i = 0; i < 24; i++) {
-            printf("%02d:00 - %02d:59: %d requests\n", i, i, stats.time_stats.counts_per_hour[i]);
+            printf("%02d:00 - %02d:59: %lld requests\n", i, i, (long long)stats->time_stats.counts_per_hour[i]);
         }
     }
 
+    if (options.bucket_width > 0) {
+        print_time_series(stats);
+    }
+
+    if (options.distinct_counts) {
+        print_distinct_stats(stats);
+    }
+
+    if (options.size_quantiles) {
+        print_size_stats(stats, top_url, num_threads);
+    }
+
     free(threads);
     free(thread_data);
-    free_analyzer_stats(&stats);
+    free(cpus);
+    for (int i = 0; i < num_net_rollups; i++) {
+        free_ip_table(&net_rollups[i].table);
+    }
+    free(net_rollups);
+    free_url_normalizer(&url_normalizer);
+    free_ip_set(&ip_set);
+    free_ip_set(&ip_exclude_set);
+    if (where_text != NULL) {
+        free_filter_expr(&where);
+    }
+    free_analyzer_stats(stats);
+    free(thread_stats);
     for (int i = 0; i < num_formats; i++) {
         regfree(&formats[i].regex);
         free(formats[i].name);
         free(formats[i].pattern);
     }
     free(formats);
-    fclose(file);
+    unmap_file(&log_map);
+    if (cache_loaded) {
+        close_log_cache(&cache);
+    }
+    free(cache_filename);
+    if (block_filter_loaded || build_block_filter) {
+        close_block_filter_index(&block_filter);
+    }
+    free(block_filter_filename);
 
     return EXIT_SUCCESS;
 } 
\ No newline at end of file
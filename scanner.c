@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "scanner.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define SCAN_TARGET_SSE2 __attribute__((target("sse2")))
+#define SCAN_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SCAN_TARGET_SSE2
+#define SCAN_TARGET_AVX2
+#endif
+
+typedef const char* (*FindNewlineFn)(const char* start, const char* end);
+typedef void (*BitmapBlockFn)(const char* block, ScanBitmap* bitmap);
+typedef const char* (*FindLiteralFn)(const char* start, const char* end, const char* literal, size_t len);
+
+static const char* find_newline_scalar(const char* start, const char* end) {
+    const char* newline = (const char*)memchr(start, '\n', end - start);
+    return newline != NULL ? newline : end;
+}
+
+static const char* find_literal_scalar(const char* start, const char* end, const char* literal, size_t len) {
+    const char* p = start;
+    while ((size_t)(end - p) >= len) {
+        const char* hit = (const char*)memchr(p, literal[0], (size_t)(end - p) - len + 1);
+        if (hit == NULL) {
+            break;
+        }
+        if (memcmp(hit, literal, len) == 0) {
+            return hit;
+        }
+        p = hit + 1;
+    }
+    return end;
+}
+
+static void bitmap_block_scalar(const char* block, ScanBitmap* bitmap) {
+    uint64_t newline = 0, space = 0, quote = 0, bracket = 0;
+    for (int i = 0; i < SCAN_BLOCK_SIZE; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        switch (block[i]) {
+            case '\n': newline |= bit; break;
+            case ' ': space |= bit; break;
+            case '"': quote |= bit; break;
+            case '[':
+            case ']': bracket |= bit; break;
+            default: break;
+        }
+    }
+    bitmap->newline = newline;
+    bitmap->space = space;
+    bitmap->quote = quote;
+    bitmap->bracket = bracket;
+}
+
+#ifdef SCAN_X86
+
+SCAN_TARGET_SSE2
+static const char* find_newline_sse2(const char* start, const char* end) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const char* p = start;
+
+    while (end - p >= 64) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), newline);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), newline);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), newline);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 48)), newline);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))) != 0) {
+            uint64_t mask = (uint64_t)(uint32_t)_mm_movemask_epi8(a)
+                          | (uint64_t)(uint32_t)_mm_movemask_epi8(b) << 16
+                          | (uint64_t)(uint32_t)_mm_movemask_epi8(c) << 32
+                          | (uint64_t)(uint32_t)_mm_movemask_epi8(d) << 48;
+            return p + scan_ctz64(mask);
+        }
+        p += 64;
+    }
+
+    while (end - p >= 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), newline));
+        if (mask != 0) {
+            return p + scan_ctz64((uint64_t)(uint32_t)mask);
+        }
+        p += 16;
+    }
+
+    return find_newline_scalar(p, end);
+}
+
+SCAN_TARGET_SSE2
+static uint64_t eq_mask_sse2(__m128i a, __m128i b, __m128i c, __m128i d, char value) {
+    const __m128i v = _mm_set1_epi8(value);
+    return (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, v))
+         | (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(b, v)) << 16
+         | (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(c, v)) << 32
+         | (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(d, v)) << 48;
+}
+
+SCAN_TARGET_SSE2
+static void bitmap_block_sse2(const char* block, ScanBitmap* bitmap) {
+    __m128i a = _mm_loadu_si128((const __m128i*)block);
+    __m128i b = _mm_loadu_si128((const __m128i*)(block + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(block + 32));
+    __m128i d = _mm_loadu_si128((const __m128i*)(block + 48));
+
+    bitmap->newline = eq_mask_sse2(a, b, c, d, '\n');
+    bitmap->space = eq_mask_sse2(a, b, c, d, ' ');
+    bitmap->quote = eq_mask_sse2(a, b, c, d, '"');
+    bitmap->bracket = eq_mask_sse2(a, b, c, d, '[') | eq_mask_sse2(a, b, c, d, ']');
+}
+
+// Candidates are positions where both the first and the last byte of the
+// literal match, 16 at a time; only those are compared in full.
+SCAN_TARGET_SSE2
+static const char* find_literal_sse2(const char* start, const char* end, const char* literal, size_t len) {
+    const __m128i first = _mm_set1_epi8(literal[0]);
+    const __m128i last = _mm_set1_epi8(literal[len - 1]);
+    const char* p = start;
+
+    while ((size_t)(end - p) >= len - 1 + 16) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), first);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + len - 1)), last);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(a, b));
+        while (mask != 0) {
+            int i = scan_ctz64(mask);
+            if (memcmp(p + i, literal, len) == 0) {
+                return p + i;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+
+    return find_literal_scalar(p, end, literal, len);
+}
+
+SCAN_TARGET_AVX2
+static const char* find_newline_avx2(const char* start, const char* end) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const char* p = start;
+
+    while (end - p >= 64) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), newline);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 32)), newline);
+        if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) {
+            uint64_t mask = (uint64_t)(uint32_t)_mm256_movemask_epi8(a)
+                          | (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+            return p + scan_ctz64(mask);
+        }
+        p += 64;
+    }
+
+    while (end - p >= 32) {
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), newline));
+        if (mask != 0) {
+            return p + scan_ctz64(mask);
+        }
+        p += 32;
+    }
+
+    return find_newline_scalar(p, end);
+}
+
+SCAN_TARGET_AVX2
+static uint64_t eq_mask_avx2(__m256i lo, __m256i hi, char value) {
+    const __m256i v = _mm256_set1_epi8(value);
+    return (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, v))
+         | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, v)) << 32;
+}
+
+SCAN_TARGET_AVX2
+static void bitmap_block_avx2(const char* block, ScanBitmap* bitmap) {
+    __m256i lo = _mm256_loadu_si256((const __m256i*)block);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(block + 32));
+
+    bitmap->newline = eq_mask_avx2(lo, hi, '\n');
+    bitmap->space = eq_mask_avx2(lo, hi, ' ');
+    bitmap->quote = eq_mask_avx2(lo, hi, '"');
+    bitmap->bracket = eq_mask_avx2(lo, hi, '[') | eq_mask_avx2(lo, hi, ']');
+}
+
+SCAN_TARGET_AVX2
+static const char* find_literal_avx2(const char* start, const char* end, const char* literal, size_t len) {
+    const __m256i first = _mm256_set1_epi8(literal[0]);
+    const __m256i last = _mm256_set1_epi8(literal[len - 1]);
+    const char* p = start;
+
+    while ((size_t)(end - p) >= len - 1 + 32) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), first);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + len - 1)), last);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(a, b));
+        while (mask != 0) {
+            int i = scan_ctz64(mask);
+            if (memcmp(p + i, literal, len) == 0) {
+                return p + i;
+            }
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+
+    return find_literal_scalar(p, end, literal, len);
+}
+
+static bool cpu_has_sse2(void) {
+#if defined(__x86_64__) || defined(_M_X64)
+    return true;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static bool cpu_has_avx2(void) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+
+    // AVX2 also needs the OS to save the upper YMM state.
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+static FindNewlineFn find_newline_impl = find_newline_scalar;
+static BitmapBlockFn bitmap_block_impl = bitmap_block_scalar;
+static FindLiteralFn find_literal_impl = find_literal_scalar;
+
+// Picks the widest implementation the CPU supports. Must run before the
+// worker threads start; until then the scalar versions are used.
+void init_scanner(void) {
+#ifdef SCAN_X86
+    if (cpu_has_avx2()) {
+        find_newline_impl = find_newline_avx2;
+        bitmap_block_impl = bitmap_block_avx2;
+        find_literal_impl = find_literal_avx2;
+    } else if (cpu_has_sse2()) {
+        find_newline_impl = find_newline_sse2;
+        bitmap_block_impl = bitmap_block_sse2;
+        find_literal_impl = find_literal_sse2;
+    }
+#endif
+}
+
+// Returns the first '\n' in [start, end), or end if there is none.
+const char* scan_find_newline(const char* start, const char* end) {
+    return find_newline_impl(start, end);
+}
+
+// Returns the first occurrence of literal in [start, end), or end if there
+// is none. An empty literal matches at start.
+const char* scan_find_literal(const char* start, const char* end, const char* literal, size_t len) {
+    if (len == 0) {
+        return start;
+    }
+    return find_literal_impl(start, end, literal, len);
+}
+
+// Classifies up to SCAN_BLOCK_SIZE bytes; bits past len are always clear.
+void scan_bitmap_block(const char* block, size_t len, ScanBitmap* bitmap) {
+    if (len >= SCAN_BLOCK_SIZE) {
+        bitmap_block_impl(block, bitmap);
+        return;
+    }
+
+    char padded[SCAN_BLOCK_SIZE] = {0};
+    memcpy(padded, block, len);
+    bitmap_block_impl(padded, bitmap);
+}
@@ -0,0 +1,43 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define SCAN_BLOCK_SIZE 64
+
+// Bit i of each mask is set when byte i of the block is that delimiter.
+typedef struct {
+    uint64_t newline;
+    uint64_t space;
+    uint64_t quote;
+    uint64_t bracket;
+} ScanBitmap;
+
+void init_scanner(void);
+const char* scan_find_newline(const char* start, const char* end);
+const char* scan_find_literal(const char* start, const char* end, const char* literal, size_t len);
+void scan_bitmap_block(const char* block, size_t len, ScanBitmap* bitmap);
+
+static inline int scan_ctz64(uint64_t mask) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (int)index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if (_BitScanForward(&index, (unsigned long)mask)) {
+        return (int)index;
+    }
+    _BitScanForward(&index, (unsigned long)(mask >> 32));
+    return (int)index + 32;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+#endif
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "scheduler.h"
+
+void init_block_scheduler(BlockScheduler* scheduler, size_t data_size, size_t block_size, int num_workers) {
+    scheduler->data_size = data_size;
+    scheduler->block_size = block_size;
+    scheduler->num_blocks = (data_size + block_size - 1) / block_size;
+    scheduler->num_workers = num_workers;
+    scheduler->deques = (BlockDeque*)malloc(num_workers * sizeof(BlockDeque));
+
+    // Each worker starts with a contiguous run of blocks.
+    for (int i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&scheduler->deques[i].mutex, NULL);
+        scheduler->deques[i].head = scheduler->num_blocks * i / num_workers;
+        scheduler->deques[i].tail = scheduler->num_blocks * (i + 1) / num_workers;
+    }
+}
+
+void free_block_scheduler(BlockScheduler* scheduler) {
+    for (int i = 0; i < scheduler->num_workers; i++) {
+        pthread_mutex_destroy(&scheduler->deques[i].mutex);
+    }
+    free(scheduler->deques);
+    scheduler->deques = NULL;
+}
+
+// Byte range of the blocks initially queued for a worker.
+void scheduler_initial_range(const BlockScheduler* scheduler, int worker, size_t* start_offset, size_t* end_offset) {
+    size_t start = scheduler->deques[worker].head * scheduler->block_size;
+    size_t end = scheduler->deques[worker].tail * scheduler->block_size;
+    *start_offset = start < scheduler->data_size ? start : scheduler->data_size;
+    *end_offset = end < scheduler->data_size ? end : scheduler->data_size;
+}
+
+static void fill_block(const BlockScheduler* scheduler, size_t index, WorkBlock* block) {
+    block->start_offset = index * scheduler->block_size;
+    block->end_offset = block->start_offset + scheduler->block_size;
+    if (block->end_offset > scheduler->data_size) {
+        block->end_offset = scheduler->data_size;
+    }
+}
+
+// Hands out the worker's next block, stealing from the other workers once
+// its own deque is empty. Returns false when no work is left anywhere.
+bool scheduler_next_block(BlockScheduler* scheduler, int worker, WorkBlock* block) {
+    BlockDeque* own = &scheduler->deques[worker];
+
+    pthread_mutex_lock(&own->mutex);
+    if (own->head < own->tail) {
+        size_t index = own->head++;
+        pthread_mutex_unlock(&own->mutex);
+        fill_block(scheduler, index, block);
+        return true;
+    }
+    pthread_mutex_unlock(&own->mutex);
+
+    for (int i = 1; i < scheduler->num_workers; i++) {
+        BlockDeque* victim = &scheduler->deques[(worker + i) % scheduler->num_workers];
+
+        pthread_mutex_lock(&victim->mutex);
+        if (victim->head < victim->tail) {
+            size_t index = --victim->tail;
+            pthread_mutex_unlock(&victim->mutex);
+            fill_block(scheduler, index, block);
+            return true;
+        }
+        pthread_mutex_unlock(&victim->mutex);
+    }
+
+    return false;
+}
@@ -0,0 +1,40 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define DEFAULT_BLOCK_SIZE (1024 * 1024)
+
+// A byte range of the input. The worker that takes a block owns every line
+// whose first byte lies in [start_offset, end_offset). When aggregating
+// from a -cache file the offsets are row numbers instead.
+typedef struct {
+    size_t start_offset;
+    size_t end_offset;
+} WorkBlock;
+
+// Block indices [head, tail) still queued for one worker. The owner takes
+// from the head so it reads its range front to back; thieves take from the
+// tail, as far from the owner's position as possible.
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t head;
+    size_t tail;
+} BlockDeque;
+
+typedef struct {
+    size_t data_size;
+    size_t block_size;
+    size_t num_blocks;
+    BlockDeque* deques;
+    int num_workers;
+} BlockScheduler;
+
+void init_block_scheduler(BlockScheduler* scheduler, size_t data_size, size_t block_size, int num_workers);
+void free_block_scheduler(BlockScheduler* scheduler);
+void scheduler_initial_range(const BlockScheduler* scheduler, int worker, size_t* start_offset, size_t* end_offset);
+bool scheduler_next_block(BlockScheduler* scheduler, int worker, WorkBlock* block);
+
+#endif
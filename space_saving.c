@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "space_saving.h"
+
+#define INDEX_EMPTY (-1)
+
+static void heap_swap(SpaceSaving* ss, int a, int b) {
+    int item_a = ss->heap[a];
+    int item_b = ss->heap[b];
+    ss->heap[a] = item_b;
+    ss->heap[b] = item_a;
+    ss->items[item_b].heap_pos = a;
+    ss->items[item_a].heap_pos = b;
+}
+
+// Min-heap of item indices by count; heap[0] is the next counter to recycle.
+static void heap_sift_down(SpaceSaving* ss, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < ss->size && ss->items[ss->heap[left]].count < ss->items[ss->heap[smallest]].count) {
+            smallest = left;
+        }
+        if (right < ss->size && ss->items[ss->heap[right]].count < ss->items[ss->heap[smallest]].count) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        heap_swap(ss, i, smallest);
+        i = smallest;
+    }
+}
+
+static void heap_sift_up(SpaceSaving* ss, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (ss->items[ss->heap[parent]].count <= ss->items[ss->heap[i]].count) {
+            return;
+        }
+        heap_swap(ss, i, parent);
+        i = parent;
+    }
+}
+
+static size_t index_find(const SpaceSaving* ss, const char* key, size_t key_len, uint64_t hash) {
+    size_t i = (size_t)hash & ss->index_mask;
+    while (ss->index[i] != INDEX_EMPTY) {
+        const HeavyHitter* item = &ss->items[ss->index[i]];
+        if (item->hash == hash && item->key_len == key_len && memcmp(item->key, key, key_len) == 0) {
+            return i;
+        }
+        i = (i + 1) & ss->index_mask;
+    }
+    return i;
+}
+
+// Backward-shift deletion keeps linear probing chains intact without
+// tombstones.
+static void index_remove(SpaceSaving* ss, size_t i) {
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & ss->index_mask;
+        if (ss->index[j] == INDEX_EMPTY) {
+            break;
+        }
+        size_t home = (size_t)ss->items[ss->index[j]].hash & ss->index_mask;
+        bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            ss->index[i] = ss->index[j];
+            i = j;
+        }
+    }
+    ss->index[i] = INDEX_EMPTY;
+}
+
+static void set_key(HeavyHitter* item, const char* key, size_t key_len, uint64_t hash) {
+    if (key_len + 1 > item->key_capacity) {
+        item->key_capacity = key_len + 1;
+        item->key = (char*)realloc(item->key, item->key_capacity);
+    }
+    memcpy(item->key, key, key_len);
+    item->key[key_len] = '\0';
+    item->key_len = key_len;
+    item->hash = hash;
+}
+
+void init_space_saving(SpaceSaving* ss, int capacity) {
+    size_t index_capacity = 1;
+    while (index_capacity < (size_t)capacity * 2) {
+        index_capacity *= 2;
+    }
+
+    ss->capacity = capacity;
+    ss->size = 0;
+    ss->items = (HeavyHitter*)calloc(capacity, sizeof(HeavyHitter));
+    ss->heap = (int*)malloc(capacity * sizeof(int));
+    ss->index = (int*)malloc(index_capacity * sizeof(int));
+    ss->index_mask = index_capacity - 1;
+    ss->total = 0;
+    for (size_t i = 0; i < index_capacity; i++) {
+        ss->index[i] = INDEX_EMPTY;
+    }
+}
+
+void free_space_saving(SpaceSaving* ss) {
+    for (int i = 0; i < ss->capacity; i++) {
+        free(ss->items[i].key);
+    }
+    free(ss->items);
+    free(ss->heap);
+    free(ss->index);
+    ss->items = NULL;
+    ss->heap = NULL;
+    ss->index = NULL;
+    ss->size = 0;
+}
+
+// Adds a key that is not in the summary; the summary must not be full.
+static void insert_new(SpaceSaving* ss, size_t slot, const char* key, size_t key_len, uint64_t hash,
+                       int64_t count, int64_t error) {
+    int idx = ss->size++;
+    HeavyHitter* item = &ss->items[idx];
+    set_key(item, key, key_len, hash);
+    item->count = count;
+    item->error = error;
+    item->heap_pos = idx;
+    ss->heap[idx] = idx;
+    ss->index[slot] = idx;
+    heap_sift_up(ss, idx);
+}
+
+void space_saving_add(SpaceSaving* ss, const char* key, size_t key_len, uint64_t hash, int64_t count) {
+    ss->total += count;
+
+    size_t slot = index_find(ss, key, key_len, hash);
+    if (ss->index[slot] != INDEX_EMPTY) {
+        HeavyHitter* item = &ss->items[ss->index[slot]];
+        item->count += count;
+        heap_sift_down(ss, item->heap_pos);
+        return;
+    }
+
+    if (ss->size < ss->capacity) {
+        insert_new(ss, slot, key, key_len, hash, count, 0);
+        return;
+    }
+
+    int victim = ss->heap[0];
+    HeavyHitter* item = &ss->items[victim];
+    index_remove(ss, index_find(ss, item->key, item->key_len, item->hash));
+
+    set_key(item, key, key_len, hash);
+    item->error = item->count;
+    item->count += count;
+    ss->index[index_find(ss, key, key_len, hash)] = victim;
+    heap_sift_down(ss, 0);
+}
+
+// Smallest count a key missing from the summary could have had; 0 until the
+// summary has had to recycle counters.
+static int64_t missing_count(const SpaceSaving* ss) {
+    return ss->size < ss->capacity ? 0 : ss->items[ss->heap[0]].count;
+}
+
+// Upper bound on the error of any reported count.
+int64_t space_saving_max_error(const SpaceSaving* ss) {
+    return missing_count(ss);
+}
+
+typedef struct {
+    const HeavyHitter* item;
+    int64_t count;
+    int64_t error;
+} MergeCandidate;
+
+static int compare_candidates(const void* a, const void* b) {
+    const MergeCandidate* x = (const MergeCandidate*)a;
+    const MergeCandidate* y = (const MergeCandidate*)b;
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
+    }
+    size_t len = x->item->key_len < y->item->key_len ? x->item->key_len : y->item->key_len;
+    int cmp = memcmp(x->item->key, y->item->key, len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return x->item->key_len < y->item->key_len ? -1 : (x->item->key_len > y->item->key_len ? 1 : 0);
+}
+
+// Combines two summaries of the same capacity. A key missing from one side
+// is charged that side's smallest count, both as count and as error, so the
+// merged counts stay upper bounds with the same error guarantee as a single
+// summary over the concatenated input.
+void space_saving_merge(SpaceSaving* dst, SpaceSaving* src) {
+    int64_t dst_missing = missing_count(dst);
+    int64_t src_missing = missing_count(src);
+
+    MergeCandidate* candidates = (MergeCandidate*)malloc((dst->size + src->size) * sizeof(MergeCandidate));
+    int num_candidates = 0;
+
+    for (int i = 0; i < dst->size; i++) {
+        const HeavyHitter* item = &dst->items[i];
+        size_t slot = index_find(src, item->key, item->key_len, item->hash);
+        MergeCandidate* c = &candidates[num_candidates++];
+        c->item = item;
+        if (src->index[slot] != INDEX_EMPTY) {
+            c->count = item->count + src->items[src->index[slot]].count;
+            c->error = item->error + src->items[src->index[slot]].error;
+        } else {
+            c->count = item->count + src_missing;
+            c->error = item->error + src_missing;
+        }
+    }
+
+    for (int i = 0; i < src->size; i++) {
+        const HeavyHitter* item = &src->items[i];
+        size_t slot = index_find(dst, item->key, item->key_len, item->hash);
+        if (dst->index[slot] != INDEX_EMPTY) {
+            continue;
+        }
+        MergeCandidate* c = &candidates[num_candidates++];
+        c->item = item;
+        c->count = item->count + dst_missing;
+        c->error = item->error + dst_missing;
+    }
+
+    qsort(candidates, num_candidates, sizeof(MergeCandidate), compare_candidates);
+
+    SpaceSaving merged;
+    init_space_saving(&merged, dst->capacity);
+    merged.total = dst->total + src->total;
+    int keep = num_candidates < merged.capacity ? num_candidates : merged.capacity;
+    for (int i = 0; i < keep; i++) {
+        const HeavyHitter* item = candidates[i].item;
+        size_t slot = index_find(&merged, item->key, item->key_len, item->hash);
+        insert_new(&merged, slot, item->key, item->key_len, item->hash, candidates[i].count, candidates[i].error);
+    }
+
+    free(candidates);
+    free_space_saving(dst);
+    *dst = merged;
+}
+
+// Stores up to n items in out, highest count first; equal counts are
+// ordered by key.
+int space_saving_top_n(SpaceSaving* ss, int n, HeavyHitter** out) {
+    MergeCandidate* sorted = (MergeCandidate*)malloc(ss->size * sizeof(MergeCandidate));
+    for (int i = 0; i < ss->size; i++) {
+        sorted[i].item = &ss->items[i];
+        sorted[i].count = ss->items[i].count;
+        sorted[i].error = ss->items[i].error;
+    }
+    qsort(sorted, ss->size, sizeof(MergeCandidate), compare_candidates);
+
+    int count = n < ss->size ? n : ss->size;
+    for (int i = 0; i < count; i++) {
+        out[i] = (HeavyHitter*)sorted[i].item;
+    }
+
+    free(sorted);
+    return count;
+}
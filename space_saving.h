@@ -0,0 +1,40 @@
+#ifndef SPACE_SAVING_H
+#define SPACE_SAVING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The true frequency of the key lies in [count - error, count].
+typedef struct {
+    uint64_t hash;
+    char* key;
+    size_t key_len;
+    size_t key_capacity;
+    int64_t count;
+    int64_t error;
+    int heap_pos;
+} HeavyHitter;
+
+// Space-Saving summary with a fixed number of counters. When it is full, a
+// new key takes over the counter with the smallest count and inherits that
+// count as its error, so every key seen more than total / capacity times is
+// guaranteed to be present.
+typedef struct {
+    HeavyHitter* items;
+    int capacity;
+    int size;
+    int* heap;
+    int* index;
+    size_t index_mask;
+    int64_t total;
+} SpaceSaving;
+
+void init_space_saving(SpaceSaving* ss, int capacity);
+void free_space_saving(SpaceSaving* ss);
+void space_saving_add(SpaceSaving* ss, const char* key, size_t key_len, uint64_t hash, int64_t count);
+void space_saving_merge(SpaceSaving* dst, SpaceSaving* src);
+int64_t space_saving_max_error(const SpaceSaving* ss);
+int space_saving_top_n(SpaceSaving* ss, int n, HeavyHitter** out);
+
+#endif
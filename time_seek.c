@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "time_seek.h"
+
+// First position from which every entry has a time of at least target.
+// Entries without a time (unparsed lines) never decide a step.
+static size_t lower_bound(TimeProbeFn probe, void* context, size_t size, int64_t target) {
+    size_t low = 0;
+    size_t high = size;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        size_t next;
+        int64_t time;
+        if (!probe(context, mid, high, &next, &time) || time >= target) {
+            high = mid;
+        } else {
+            low = next;
+        }
+    }
+    return low;
+}
+
+// Samples the input at even intervals; a log that was concatenated out of
+// order or mixes servers fails here and is scanned in full.
+static bool looks_time_ordered(TimeProbeFn probe, void* context, size_t size) {
+    int64_t latest = INT64_MIN;
+    for (int i = 0; i < TIME_SEEK_SAMPLES; i++) {
+        size_t position = size / TIME_SEEK_SAMPLES * (size_t)i;
+        size_t next;
+        int64_t time;
+        if (!probe(context, position, size, &next, &time)) {
+            continue;
+        }
+        if (latest != INT64_MIN && time < latest - TIME_SEEK_SLACK) {
+            return false;
+        }
+        latest = time > latest ? time : latest;
+    }
+    return true;
+}
+
+// Narrows [0, size) to the positions [*start, *end) that can hold entries
+// between start_time and end_time (0 for an open end), by binary search
+// over an input that is in time order apart from TIME_SEEK_SLACK. Returns
+// false, with the whole input as the range, if the input does not look
+// time-ordered. The per-entry time filters still have to be applied.
+bool seek_time_range(TimeProbeFn probe, void* context, size_t size, int64_t start_time, int64_t end_time,
+                     size_t* start, size_t* end) {
+    *start = 0;
+    *end = size;
+    if (size == 0 || !looks_time_ordered(probe, context, size)) {
+        return false;
+    }
+
+    if (start_time > 0) {
+        *start = lower_bound(probe, context, size, start_time - TIME_SEEK_SLACK);
+    }
+    if (end_time > 0) {
+        *end = lower_bound(probe, context, size, end_time + TIME_SEEK_SLACK + 1);
+    }
+    if (*end < *start) {
+        *end = *start;
+    }
+    return true;
+}
@@ -0,0 +1,24 @@
+#ifndef TIME_SEEK_H
+#define TIME_SEEK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lines may be written up to this many seconds out of time order (a server
+// logs a request when it completes, stamped with its start). Ranges found
+// by seek_time_range are widened by it on both sides.
+#define TIME_SEEK_SLACK 300
+// Evenly spaced probes that must all be in order, within the slack, before
+// an input is searched instead of scanned.
+#define TIME_SEEK_SAMPLES 64
+
+// Finds the first entry with a time at or after position and before limit.
+// Sets *time and *next, the position just past that entry; returns false if
+// there is none. Positions are byte offsets of a log or rows of a cache.
+typedef bool (*TimeProbeFn)(void* context, size_t position, size_t limit, size_t* next, int64_t* time);
+
+bool seek_time_range(TimeProbeFn probe, void* context, size_t size, int64_t start_time, int64_t end_time,
+                     size_t* start, size_t* end);
+
+#endif
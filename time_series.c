@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "time_series.h"
+
+#define TIME_SERIES_INITIAL_BUCKETS 64
+
+void init_time_series(TimeSeries* series, int64_t width) {
+    series->width = width;
+    series->origin = 0;
+    series->buckets = NULL;
+    series->num_buckets = 0;
+    series->dropped = 0;
+}
+
+void free_time_series(TimeSeries* series) {
+    free(series->buckets);
+    series->buckets = NULL;
+    series->num_buckets = 0;
+}
+
+// Start of the bucket holding time, rounding towards minus infinity.
+static int64_t bucket_start(const TimeSeries* series, int64_t time) {
+    int64_t start = time - time % series->width;
+    return start > time ? start - series->width : start;
+}
+
+// Moves the buckets into a new array that starts at origin and holds
+// num_buckets buckets; the new range must contain the old one.
+static void relocate(TimeSeries* series, int64_t origin, size_t num_buckets) {
+    TimeBucket* buckets = (TimeBucket*)calloc(num_buckets, sizeof(TimeBucket));
+    if (series->buckets != NULL) {
+        size_t shift = (size_t)((series->origin - origin) / series->width);
+        memcpy(buckets + shift, series->buckets, series->num_buckets * sizeof(TimeBucket));
+        free(series->buckets);
+    }
+    series->buckets = buckets;
+    series->origin = origin;
+    series->num_buckets = num_buckets;
+}
+
+// Grows the range to cover [first, last] (bucket starts). Growth at least
+// doubles the range in the direction it extends, so logs read in order
+// reallocate only a logarithmic number of times. Returns false if the
+// range would exceed TIME_SERIES_MAX_BUCKETS.
+static bool cover(TimeSeries* series, int64_t first, int64_t last) {
+    if (series->buckets == NULL) {
+        int64_t span = (last - first) / series->width + 1;
+        if ((uint64_t)span > TIME_SERIES_MAX_BUCKETS) {
+            return false;
+        }
+        size_t num_buckets = (size_t)span > TIME_SERIES_INITIAL_BUCKETS ? (size_t)span : TIME_SERIES_INITIAL_BUCKETS;
+        relocate(series, first, num_buckets);
+        return true;
+    }
+
+    int64_t end = series->origin + (int64_t)series->num_buckets * series->width;
+    if (first >= series->origin && last < end) {
+        return true;
+    }
+
+    int64_t low = first < series->origin ? first : series->origin;
+    int64_t high = last >= end ? last + series->width : end;
+    uint64_t needed = (uint64_t)((high - low) / series->width);
+    if (needed > TIME_SERIES_MAX_BUCKETS) {
+        return false;
+    }
+
+    uint64_t num_buckets = needed;
+    if (num_buckets < 2 * series->num_buckets) {
+        num_buckets = 2 * series->num_buckets;
+    }
+    if (num_buckets > TIME_SERIES_MAX_BUCKETS) {
+        num_buckets = TIME_SERIES_MAX_BUCKETS;
+    }
+
+    // The slack goes on the side that had to grow.
+    int64_t slack = (int64_t)(num_buckets - needed) * series->width;
+    int64_t origin = first < series->origin ? low - slack : low;
+    relocate(series, origin, (size_t)num_buckets);
+    return true;
+}
+
+void time_series_add(TimeSeries* series, int64_t time, int status_class, int64_t bytes) {
+    int64_t start = bucket_start(series, time);
+    if (!cover(series, start, start)) {
+        series->dropped++;
+        return;
+    }
+
+    TimeBucket* bucket = &series->buckets[(start - series->origin) / series->width];
+    bucket->requests++;
+    bucket->bytes += bytes;
+    bucket->status_classes[status_class]++;
+}
+
+// Both series must have the same width. Buckets are plain int64_t arrays,
+// so the overlapping range is added as one flat loop the compiler can
+// vectorize.
+void time_series_merge(TimeSeries* dst, const TimeSeries* src) {
+    dst->dropped += src->dropped;
+    if (src->buckets == NULL) {
+        return;
+    }
+
+    int64_t src_last = src->origin + (int64_t)(src->num_buckets - 1) * src->width;
+    if (!cover(dst, src->origin, src_last)) {
+        // Only possible when the ranges together are too wide; add bucket by
+        // bucket so that what fits is kept.
+        for (size_t i = 0; i < src->num_buckets; i++) {
+            const TimeBucket* bucket = &src->buckets[i];
+            int64_t start = src->origin + (int64_t)i * src->width;
+            if (bucket->requests == 0) {
+                continue;
+            }
+            if (!cover(dst, start, start)) {
+                dst->dropped += bucket->requests;
+                continue;
+            }
+            TimeBucket* target = &dst->buckets[(start - dst->origin) / dst->width];
+            target->requests += bucket->requests;
+            target->bytes += bucket->bytes;
+            for (int c = 0; c < TIME_SERIES_STATUS_CLASSES; c++) {
+                target->status_classes[c] += bucket->status_classes[c];
+            }
+        }
+        return;
+    }
+
+    size_t shift = (size_t)((src->origin - dst->origin) / dst->width);
+    int64_t* target = (int64_t*)(dst->buckets + shift);
+    const int64_t* source = (const int64_t*)src->buckets;
+    size_t count = src->num_buckets * (sizeof(TimeBucket) / sizeof(int64_t));
+    for (size_t i = 0; i < count; i++) {
+        target[i] += source[i];
+    }
+}
+
+// Inverse of the days_from_civil conversion used for parsing (Howard
+// Hinnant's algorithm), so no time zone functions are involved.
+static void civil_from_days(int64_t days, int* year, int* month, int* day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t day_of_era = days - era * 146097;
+    int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int64_t mp = (5 * day_of_year + 2) / 153;
+    *day = (int)(day_of_year - (153 * mp + 2) / 5 + 1);
+    *month = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *year = (int)(year_of_era + era * 400 + (*month <= 2));
+}
+
+// Formats seconds since 1970-01-01 00:00:00 as "YYYY-MM-DD HH:MM:SS".
+void format_series_time(int64_t time, char* buffer, size_t buffer_size) {
+    int64_t days = time / 86400;
+    int64_t second_of_day = time % 86400;
+    if (second_of_day < 0) {
+        second_of_day += 86400;
+        days--;
+    }
+
+    int year, month, day;
+    civil_from_days(days, &year, &month, &day);
+    snprintf(buffer, buffer_size, "%04d-%02d-%02d %02d:%02d:%02d", year, month, day,
+             (int)(second_of_day / 3600), (int)(second_of_day / 60 % 60), (int)(second_of_day % 60));
+}
+
+// Formats a width in the largest unit that divides it, e.g. "10s" or "1h".
+void format_series_width(int64_t width, char* buffer, size_t buffer_size) {
+    if (width % 86400 == 0) {
+        snprintf(buffer, buffer_size, "%lldd", (long long)(width / 86400));
+    } else if (width % 3600 == 0) {
+        snprintf(buffer, buffer_size, "%lldh", (long long)(width / 3600));
+    } else if (width % 60 == 0) {
+        snprintf(buffer, buffer_size, "%lldm", (long long)(width / 60));
+    } else {
+        snprintf(buffer, buffer_size, "%llds", (long long)width);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef TIME_SERIES_H
+#define TIME_SERIES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIME_SERIES_STATUS_CLASSES 6
+
+// One cache line per bucket. status_classes is indexed by code / 100, with
+// 0 for codes outside 100-599.
+typedef struct {
+    int64_t requests;
+    int64_t bytes;
+    int64_t status_classes[TIME_SERIES_STATUS_CLASSES];
+} TimeBucket;
+
+// Fixed-width buckets over a contiguous time range: buckets[i] starts at
+// origin + i * width seconds. The range grows on demand to cover every time
+// added, up to TIME_SERIES_MAX_BUCKETS; times beyond that are only counted
+// in dropped.
+typedef struct {
+    int64_t width;
+    int64_t origin;
+    TimeBucket* buckets;
+    size_t num_buckets;
+    int64_t dropped;
+} TimeSeries;
+
+#define TIME_SERIES_MAX_BUCKETS ((size_t)1 << 22)
+
+void init_time_series(TimeSeries* series, int64_t width);
+void free_time_series(TimeSeries* series);
+void time_series_add(TimeSeries* series, int64_t time, int status_class, int64_t bytes);
+void time_series_merge(TimeSeries* dst, const TimeSeries* src);
+void format_series_time(int64_t time, char* buffer, size_t buffer_size);
+void format_series_width(int64_t width, char* buffer, size_t buffer_size);
+
+#endif
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "top_n.h"
+
+#define TOP_N_MIN_SHARD_SLOTS (64 * 1024)
+
+// Min-heap on rank: heap[0] is the lowest-ranked slot kept so far.
+static void heap_sift_down(const void** heap, int size, int i, SlotRanksBeforeFn ranks_before) {
+    for (;;) {
+        int worst = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < size && ranks_before(heap[worst], heap[left])) {
+            worst = left;
+        }
+        if (right < size && ranks_before(heap[worst], heap[right])) {
+            worst = right;
+        }
+        if (worst == i) {
+            return;
+        }
+        const void* temp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = temp;
+        i = worst;
+    }
+}
+
+static void heap_push(const void** heap, int* size, int n, const void* slot, SlotRanksBeforeFn ranks_before) {
+    if (*size < n) {
+        int i = (*size)++;
+        heap[i] = slot;
+        while (i > 0) {
+            int parent = (i - 1) / 2;
+            if (!ranks_before(heap[parent], heap[i])) {
+                break;
+            }
+            const void* temp = heap[i];
+            heap[i] = heap[parent];
+            heap[parent] = temp;
+            i = parent;
+        }
+    } else if (ranks_before(slot, heap[0])) {
+        heap[0] = slot;
+        heap_sift_down(heap, *size, 0, ranks_before);
+    }
+}
+
+typedef struct {
+    const char* slots;
+    size_t slot_size;
+    size_t begin;
+    size_t end;
+    SlotUsedFn is_used;
+    SlotRanksBeforeFn ranks_before;
+    int n;
+    const void** heap;
+    int size;
+} TopNShard;
+
+static void* top_n_shard(void* arg) {
+    TopNShard* shard = (TopNShard*)arg;
+    shard->size = 0;
+    for (size_t i = shard->begin; i < shard->end; i++) {
+        const void* slot = shard->slots + i * shard->slot_size;
+        if (shard->is_used(slot)) {
+            heap_push(shard->heap, &shard->size, shard->n, slot, shard->ranks_before);
+        }
+    }
+    return NULL;
+}
+
+// Stores pointers to the n highest-ranked used slots of a slot array in out,
+// best first, and returns how many were stored. Large arrays are split into
+// ranges that are scanned in parallel by up to num_threads threads, each
+// keeping its own bounded heap; the heaps are then merged and sorted.
+int select_top_n(const void* slots, size_t slot_size, size_t capacity,
+                 SlotUsedFn is_used, SlotRanksBeforeFn ranks_before,
+                 int n, int num_threads, const void** out) {
+    if (n <= 0 || capacity == 0) {
+        return 0;
+    }
+
+    int num_shards = num_threads;
+    if ((size_t)num_shards > capacity / TOP_N_MIN_SHARD_SLOTS) {
+        num_shards = (int)(capacity / TOP_N_MIN_SHARD_SLOTS);
+    }
+    if (num_shards < 1) {
+        num_shards = 1;
+    }
+
+    TopNShard* shards = (TopNShard*)malloc(num_shards * sizeof(TopNShard));
+    pthread_t* threads = (pthread_t*)malloc(num_shards * sizeof(pthread_t));
+    const void** heaps = (const void**)malloc((size_t)num_shards * n * sizeof(const void*));
+
+    size_t shard_slots = capacity / num_shards;
+    for (int i = 0; i < num_shards; i++) {
+        shards[i].slots = (const char*)slots;
+        shards[i].slot_size = slot_size;
+        shards[i].begin = i * shard_slots;
+        shards[i].end = i == num_shards - 1 ? capacity : (i + 1) * shard_slots;
+        shards[i].is_used = is_used;
+        shards[i].ranks_before = ranks_before;
+        shards[i].n = n;
+        shards[i].heap = heaps + (size_t)i * n;
+    }
+
+    int started = 0;
+    for (int i = 1; i < num_shards; i++) {
+        if (pthread_create(&threads[i], NULL, top_n_shard, &shards[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    // Shards that did not get a thread are scanned here.
+    top_n_shard(&shards[0]);
+    for (int i = started + 1; i < num_shards; i++) {
+        top_n_shard(&shards[i]);
+    }
+    for (int i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int size = 0;
+    for (int i = 0; i < num_shards; i++) {
+        for (int j = 0; j < shards[i].size; j++) {
+            heap_push(out, &size, n, shards[i].heap[j], ranks_before);
+        }
+    }
+
+    // Popping the worst slot into the last free position leaves out sorted.
+    for (int end = size - 1; end > 0; end--) {
+        const void* temp = out[0];
+        out[0] = out[end];
+        out[end] = temp;
+        heap_sift_down(out, end, 0, ranks_before);
+    }
+
+    free(heaps);
+    free(threads);
+    free(shards);
+    return size;
+}
@@ -0,0 +1,15 @@
+#ifndef TOP_N_H
+#define TOP_N_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef bool (*SlotUsedFn)(const void* slot);
+// Returns true when slot a must be reported before slot b.
+typedef bool (*SlotRanksBeforeFn)(const void* a, const void* b);
+
+int select_top_n(const void* slots, size_t slot_size, size_t capacity,
+                 SlotUsedFn is_used, SlotRanksBeforeFn ranks_before,
+                 int n, int num_threads, const void** out);
+
+#endif
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#include "url_normalizer.h"
+
+// Longer hex segments are taken for identifiers (hashes, object ids).
+#define HEX_SEGMENT_MIN_LEN 8
+// Queries with more parameters are kept in their original order.
+#define MAX_SORTED_PARAMS 32
+
+// One path segment of the route trie. Literal children are matched before
+// the wildcard child, and a route is recorded where a template ends.
+struct RouteNode {
+    char* segment;
+    size_t segment_len;
+    RouteNode** children;
+    int num_children;
+    RouteNode* wildcard;
+    char* route;
+};
+
+typedef enum {
+    SEGMENT_PLAIN,
+    SEGMENT_NUM,
+    SEGMENT_UUID,
+    SEGMENT_HEX
+} SegmentKind;
+
+static const char* segment_placeholders[] = {NULL, "{num}", "{uuid}", "{hex}"};
+
+static char* copy_text(const char* text, size_t len) {
+    char* copy = (char*)malloc(len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static RouteNode* create_route_node(const char* segment, size_t len) {
+    RouteNode* node = (RouteNode*)calloc(1, sizeof(RouteNode));
+    node->segment = copy_text(segment, len);
+    node->segment_len = len;
+    return node;
+}
+
+static void free_route_node(RouteNode* node) {
+    if (node == NULL) {
+        return;
+    }
+    for (int i = 0; i < node->num_children; i++) {
+        free_route_node(node->children[i]);
+    }
+    free_route_node(node->wildcard);
+    free(node->children);
+    free(node->segment);
+    free(node->route);
+    free(node);
+}
+
+void init_url_normalizer(UrlNormalizer* normalizer, QueryMode query_mode, bool collapse_segments) {
+    normalizer->query_mode = query_mode;
+    normalizer->collapse_segments = collapse_segments;
+    normalizer->routes = NULL;
+}
+
+void free_url_normalizer(UrlNormalizer* normalizer) {
+    free_route_node(normalizer->routes);
+    normalizer->routes = NULL;
+}
+
+bool url_normalizer_is_active(const UrlNormalizer* normalizer) {
+    return normalizer->query_mode != QUERY_KEEP || normalizer->collapse_segments || normalizer->routes != NULL;
+}
+
+static bool is_wildcard_segment(const char* segment, size_t len) {
+    return (len == 1 && segment[0] == '*') || (len >= 2 && segment[0] == '{' && segment[len - 1] == '}');
+}
+
+static const char* segment_end(const char* p, const char* end) {
+    const char* slash = (const char*)memchr(p, '/', end - p);
+    return slash != NULL ? slash : end;
+}
+
+// Adds a template such as "/api/users/{id}/orders"; a segment written as
+// {name} or * matches any single segment. If two templates have the same
+// shape, the first one is kept.
+bool url_normalizer_add_route(UrlNormalizer* normalizer, const char* route) {
+    size_t len = strlen(route);
+    if (len == 0 || route[0] != '/') {
+        return false;
+    }
+
+    if (normalizer->routes == NULL) {
+        normalizer->routes = create_route_node("", 0);
+    }
+
+    RouteNode* node = normalizer->routes;
+    const char* end = route + len;
+    const char* p = route + 1;
+    for (;;) {
+        const char* q = segment_end(p, end);
+        size_t segment_len = (size_t)(q - p);
+
+        if (is_wildcard_segment(p, segment_len)) {
+            if (node->wildcard == NULL) {
+                node->wildcard = create_route_node(p, segment_len);
+            }
+            node = node->wildcard;
+        } else {
+            RouteNode* child = NULL;
+            for (int i = 0; i < node->num_children; i++) {
+                if (node->children[i]->segment_len == segment_len && memcmp(node->children[i]->segment, p, segment_len) == 0) {
+                    child = node->children[i];
+                    break;
+                }
+            }
+            if (child == NULL) {
+                child = create_route_node(p, segment_len);
+                node->children = (RouteNode**)realloc(node->children, (node->num_children + 1) * sizeof(RouteNode*));
+                node->children[node->num_children++] = child;
+            }
+            node = child;
+        }
+
+        if (q == end) {
+            break;
+        }
+        p = q + 1;
+    }
+
+    if (node->route == NULL) {
+        node->route = copy_text(route, len);
+    }
+    return true;
+}
+
+// One template per line; empty lines and lines starting with # are skipped.
+bool load_url_routes(UrlNormalizer* normalizer, const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    char line[4096];
+    int line_number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        size_t len = strlen(line);
+        while (len > 0 && isspace((unsigned char)line[len - 1])) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        if (!url_normalizer_add_route(normalizer, line)) {
+            fprintf(stderr, "Error: Invalid route template on line %d of '%s'\n", line_number, filename);
+            ok = false;
+            break;
+        }
+    }
+
+    fclose(file);
+    return ok;
+}
+
+// p is the start of a segment, just past a '/'.
+static const RouteNode* match_route(const RouteNode* node, const char* p, const char* end) {
+    const char* q = segment_end(p, end);
+    size_t segment_len = (size_t)(q - p);
+
+    for (int i = 0; i < node->num_children; i++) {
+        const RouteNode* child = node->children[i];
+        if (child->segment_len != segment_len || memcmp(child->segment, p, segment_len) != 0) {
+            continue;
+        }
+        const RouteNode* match = q == end ? (child->route != NULL ? child : NULL) : match_route(child, q + 1, end);
+        if (match != NULL) {
+            return match;
+        }
+    }
+
+    if (node->wildcard != NULL) {
+        const RouteNode* child = node->wildcard;
+        return q == end ? (child->route != NULL ? child : NULL) : match_route(child, q + 1, end);
+    }
+    return NULL;
+}
+
+static bool is_uuid(const char* segment, size_t len) {
+    if (len != 36) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        bool dash = i == 8 || i == 13 || i == 18 || i == 23;
+        if (dash ? segment[i] != '-' : !isxdigit((unsigned char)segment[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static SegmentKind classify_segment(const char* segment, size_t len) {
+    if (len == 0) {
+        return SEGMENT_PLAIN;
+    }
+
+    bool all_digits = true;
+    bool all_hex = true;
+    for (size_t i = 0; i < len && all_hex; i++) {
+        unsigned char c = (unsigned char)segment[i];
+        if (c < '0' || c > '9') {
+            all_digits = false;
+            all_hex = isxdigit(c) != 0;
+        }
+    }
+
+    if (all_digits) {
+        return SEGMENT_NUM;
+    }
+    if (all_hex && len >= HEX_SEGMENT_MIN_LEN) {
+        // Require a digit so that words such as "deadbeef" stay readable.
+        for (size_t i = 0; i < len; i++) {
+            if (segment[i] >= '0' && segment[i] <= '9') {
+                return SEGMENT_HEX;
+            }
+        }
+        return SEGMENT_PLAIN;
+    }
+    return is_uuid(segment, len) ? SEGMENT_UUID : SEGMENT_PLAIN;
+}
+
+// Like classify_segment, but a segment such as "<hash>.png" is classified
+// by the part before its last dot; stem_len is the length to replace.
+static SegmentKind classify_path_segment(const char* segment, size_t len, size_t* stem_len) {
+    *stem_len = len;
+    SegmentKind kind = classify_segment(segment, len);
+    if (kind != SEGMENT_PLAIN) {
+        return kind;
+    }
+
+    const char* dot = NULL;
+    for (size_t i = len; i > 0; i--) {
+        if (segment[i - 1] == '.') {
+            dot = segment + i - 1;
+            break;
+        }
+    }
+    // Only a name-like extension counts, so "1.5" stays as it is.
+    if (dot == NULL || dot == segment || dot + 1 == segment + len || !isalpha((unsigned char)dot[1])) {
+        return SEGMENT_PLAIN;
+    }
+    *stem_len = (size_t)(dot - segment);
+    return classify_segment(segment, *stem_len);
+}
+
+static bool path_has_id_segments(const char* path, const char* end) {
+    const char* p = path;
+    for (;;) {
+        const char* q = segment_end(p, end);
+        size_t stem_len;
+        if (classify_path_segment(p, (size_t)(q - p), &stem_len) != SEGMENT_PLAIN) {
+            return true;
+        }
+        if (q == end) {
+            return false;
+        }
+        p = q + 1;
+    }
+}
+
+static void append(char** buffer, size_t* capacity, size_t* len, const char* text, size_t text_len) {
+    if (text_len == 0) {
+        return;
+    }
+    if (*len + text_len > *capacity) {
+        size_t new_capacity = *capacity > 0 ? *capacity : 256;
+        while (*len + text_len > new_capacity) {
+            new_capacity *= 2;
+        }
+        *buffer = (char*)realloc(*buffer, new_capacity);
+        *capacity = new_capacity;
+    }
+    memcpy(*buffer + *len, text, text_len);
+    *len += text_len;
+}
+
+typedef struct {
+    const char* ptr;
+    size_t len;
+} QueryParam;
+
+static bool param_less(const QueryParam* a, const QueryParam* b) {
+    size_t len = a->len < b->len ? a->len : b->len;
+    int cmp = memcmp(a->ptr, b->ptr, len);
+    return cmp != 0 ? cmp < 0 : a->len < b->len;
+}
+
+// query points past the '?'.
+static void append_sorted_query(char** buffer, size_t* capacity, size_t* len, const char* query, const char* end) {
+    QueryParam params[MAX_SORTED_PARAMS];
+    int num_params = 0;
+
+    const char* p = query;
+    while (p < end) {
+        const char* amp = (const char*)memchr(p, '&', end - p);
+        const char* q = amp != NULL ? amp : end;
+        if (q > p) {
+            if (num_params == MAX_SORTED_PARAMS) {
+                append(buffer, capacity, len, "?", 1);
+                append(buffer, capacity, len, query, (size_t)(end - query));
+                return;
+            }
+            params[num_params].ptr = p;
+            params[num_params].len = (size_t)(q - p);
+            num_params++;
+        }
+        p = q + 1;
+    }
+
+    // Insertion sort: queries have few parameters.
+    for (int i = 1; i < num_params; i++) {
+        QueryParam param = params[i];
+        int j = i - 1;
+        while (j >= 0 && param_less(&param, &params[j])) {
+            params[j + 1] = params[j];
+            j--;
+        }
+        params[j + 1] = param;
+    }
+
+    for (int i = 0; i < num_params; i++) {
+        append(buffer, capacity, len, i == 0 ? "?" : "&", 1);
+        append(buffer, capacity, len, params[i].ptr, params[i].len);
+    }
+}
+
+// Returns the normalized form of url and stores its length in out_len. If
+// nothing changes this is url itself; otherwise the result is built in
+// *buffer, which is grown as needed and stays valid until the next call.
+const char* normalize_url(const UrlNormalizer* normalizer, const char* url, size_t len,
+                          char** buffer, size_t* capacity, size_t* out_len) {
+    const char* end = url + len;
+    const char* query = (const char*)memchr(url, '?', len);
+    const char* path_end = query != NULL ? query : end;
+
+    const RouteNode* route = NULL;
+    if (normalizer->routes != NULL && len > 0 && url[0] == '/') {
+        route = match_route(normalizer->routes, url + 1, path_end);
+    }
+
+    bool rewrite_query = query != NULL && normalizer->query_mode != QUERY_KEEP;
+    bool collapse = route == NULL && normalizer->collapse_segments && path_has_id_segments(url, path_end);
+    if (route == NULL && !rewrite_query && !collapse) {
+        *out_len = len;
+        return url;
+    }
+
+    size_t result_len = 0;
+    if (route != NULL) {
+        append(buffer, capacity, &result_len, route->route, strlen(route->route));
+    } else if (collapse) {
+        const char* p = url;
+        for (;;) {
+            const char* q = segment_end(p, path_end);
+            size_t stem_len;
+            SegmentKind kind = classify_path_segment(p, (size_t)(q - p), &stem_len);
+            if (kind == SEGMENT_PLAIN) {
+                append(buffer, capacity, &result_len, p, (size_t)(q - p));
+            } else {
+                append(buffer, capacity, &result_len, segment_placeholders[kind], strlen(segment_placeholders[kind]));
+                append(buffer, capacity, &result_len, p + stem_len, (size_t)(q - p) - stem_len);
+            }
+            if (q == path_end) {
+                break;
+            }
+            append(buffer, capacity, &result_len, "/", 1);
+            p = q + 1;
+        }
+    } else {
+        append(buffer, capacity, &result_len, url, (size_t)(path_end - url));
+    }
+
+    if (query != NULL) {
+        if (normalizer->query_mode == QUERY_KEEP) {
+            append(buffer, capacity, &result_len, query, (size_t)(end - query));
+        } else if (normalizer->query_mode == QUERY_SORT) {
+            append_sorted_query(buffer, capacity, &result_len, query + 1, end);
+        }
+    }
+
+    // A route or a stripped query can leave nothing; keep a non-empty key.
+    if (result_len == 0) {
+        append(buffer, capacity, &result_len, "/", 1);
+    }
+
+    *out_len = result_len;
+    return *buffer;
+}
@@ -0,0 +1,34 @@
+#ifndef URL_NORMALIZER_H
+#define URL_NORMALIZER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    QUERY_KEEP,
+    QUERY_STRIP,
+    // Parameters sorted, so that the same set in any order is one key.
+    QUERY_SORT
+} QueryMode;
+
+typedef struct RouteNode RouteNode;
+
+// Rewrites URLs before they are hashed and counted. A path that matches a
+// route template is replaced by the template; otherwise, with
+// collapse_segments, numeric, UUID and long hex path segments become
+// {num}, {uuid} and {hex}. Read-only once built, so all workers share one.
+typedef struct {
+    QueryMode query_mode;
+    bool collapse_segments;
+    RouteNode* routes;
+} UrlNormalizer;
+
+void init_url_normalizer(UrlNormalizer* normalizer, QueryMode query_mode, bool collapse_segments);
+void free_url_normalizer(UrlNormalizer* normalizer);
+bool url_normalizer_add_route(UrlNormalizer* normalizer, const char* route);
+bool load_url_routes(UrlNormalizer* normalizer, const char* filename);
+bool url_normalizer_is_active(const UrlNormalizer* normalizer);
+const char* normalize_url(const UrlNormalizer* normalizer, const char* url, size_t len,
+                          char** buffer, size_t* capacity, size_t* out_len);
+
+#endif